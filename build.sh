@@ -1,25 +1,35 @@
 #!/bin/bash
 set -e
 
-CFLAGS="-Wall"
+CFLAGS="-Wall -pthread"
 
 if echo "$1" | grep -q "o"; then
     CFLAGS="$CFLAGS -O2"
 fi
 if echo "$1" | grep -q "d"; then
-    CFLAGS="$CFLAGS -g -pg"
+    CFLAGS="$CFLAGS -g -pg -DCHECK_EVALUATION"
 fi
 
 set -x
 rm -rf obj
 rm -f clce
 mkdir obj
-gcc src/magic_numbers.c -o obj/magic_numbers.o -c $CFLAGS
+gcc src/find_magics.c src/slider_attacks.c src/utils.c \
+    -o obj/find_magics $CFLAGS
+gcc src/generate_attack_tables.c src/slider_attacks.c src/magic_numbers.c src/utils.c \
+    -o obj/generate_attack_tables $CFLAGS
+obj/generate_attack_tables > obj/attack_tables.c
+gcc obj/attack_tables.c -I src -o obj/attack_tables.o -c $CFLAGS
 gcc src/zobrist_numbers.c -o obj/zobrist_numbers.o -c $CFLAGS
 gcc src/utils.c -o obj/utils.o -c $CFLAGS
 gcc src/bitboards.c -o obj/bitboards.o -c $CFLAGS
 gcc src/board.c -o obj/board.o -c $CFLAGS
 gcc src/evaluate.c -o obj/evaluate.o -c $CFLAGS
+gcc src/nnue.c -o obj/nnue.o -c $CFLAGS
+gcc src/pawns.c -o obj/pawns.o -c $CFLAGS
+gcc src/transposition.c -o obj/transposition.o -c $CFLAGS
+gcc src/perft.c -o obj/perft.o -c $CFLAGS
+gcc src/move_order.c -o obj/move_order.o -c $CFLAGS
 gcc src/find_move.c -o obj/find_move.o -c $CFLAGS
 gcc src/main.c -o obj/main.o -c $CFLAGS
-gcc obj/*.o -o clce -pg
+gcc obj/*.o -o clce -pthread -pg -lm
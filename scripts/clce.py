@@ -75,6 +75,12 @@ class CLCE(Engine):
     result = self.wait_line(seconds + 2)
     move = chess.Move.from_uci(result)
     return move
+  def evaluate(self, board: chess.Board) -> int:
+    self.send_command(f"eval:{board.fen()}")
+    return int(self.wait_line(2))
+  def evaluate_batch(self, path: str) -> [int]:
+    self.send_command(f"evalbatch:{path}")
+    return [int(score) for score in self.wait_line(60).split()]
   def perft(self, board:chess.Board, depth:int, quiet:bool=False) -> Dict[chess.Move, int]:
     flag = 'q' if quiet else '_'
     self.send_command(f"perft:{board.fen()}:{depth}:{flag}")
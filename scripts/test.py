@@ -1,4 +1,4 @@
-import logging, json, sys, getopt
+import logging, json, sys, getopt, random, tempfile
 import chess
 import chess.pgn
 from clce import CLCE, Engine
@@ -74,6 +74,54 @@ class PerftTest(EngineTest):
         raise AssertionError()
     return self.perfts
 
+class EvalTest(EngineTest):
+  def configure(self):
+    # kings and pawns only, so the score is the endgame one and the king
+    # squares cancel: material, pawn squares and pawn structure
+    self.evals = [
+      # isolated passer on e4: 100 + 15, isolated -15, passed 35
+      {'board': "7k/8/8/8/4P3/8/8/K7 w - - 0 1", 'value': 135},
+      # doubled on e2 and e4: only the front pawn is passed
+      {'board': "7k/8/8/8/4P3/8/4P3/K7 w - - 0 1", 'value': 200},
+      {'board': "k7/4p3/8/4p3/8/8/8/7K b - - 0 1", 'value': -200},
+    ]
+  def run_test(self, engine: CLCE):
+    for i,case in enumerate(self.evals):
+      result = engine.evaluate(chess.Board(case['board']))
+      logging.info(f"eval {i+1}/{len(self.evals)} {result}")
+      if result != case['value']:
+        logging.warning(f"eval of {case['board']} is {result}, expected {case['value']}")
+        raise AssertionError()
+    return self.evals
+
+class EvalBatchTest(EngineTest):
+  def __init__(self, count: int):
+    self.count = count
+  def configure(self):
+    # positions from seeded random games, so failures can be reproduced
+    rng = random.Random(1)
+    self.boards = []
+    while len(self.boards) < self.count:
+      board = chess.Board()
+      while not board.is_game_over() and len(self.boards) < self.count:
+        board.push(rng.choice(list(board.legal_moves)))
+        self.boards.append(board.copy())
+  def run_test(self, engine: CLCE):
+    f = tempfile.NamedTemporaryFile('w', suffix='.fens')
+    f.write("".join(board.fen() + "\n" for board in self.boards))
+    f.flush()
+    scores = engine.evaluate_batch(f.name)
+    f.close()
+    if len(scores) != len(self.boards):
+      logging.warning(f"evalbatch gave {len(scores)} scores for {len(self.boards)} positions")
+      raise AssertionError()
+    for i,board in enumerate(self.boards):
+      expected = engine.evaluate(board)
+      if scores[i] != expected:
+        logging.warning(f"evalbatch of {board.fen()} is {scores[i]}, eval is {expected}")
+        raise AssertionError()
+    return {'positions': len(self.boards)}
+
 class PuzzleTest(EngineTest):
   def __init__(self, database: str, count: int):
     self.database = database
@@ -208,6 +256,8 @@ output = "./test_result"
 tests = None
 fast_tests = [
   PerftTest(),
+  EvalTest(),
+  EvalBatchTest(1000),
   PuzzleTest("./db/lichess_db_puzzle.csv", 5),
 ]
 game_tests = [
@@ -215,6 +265,8 @@ game_tests = [
 ]
 slow_tests = [
   PerftTest(),
+  EvalTest(),
+  EvalBatchTest(20000),
   PuzzleTest("./db/lichess_db_puzzle.csv", 100),
 ]
 verbose = False
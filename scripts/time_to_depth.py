@@ -0,0 +1,42 @@
+# Measures how long the engine takes to reach each search depth with
+# different thread counts, to check how well the parallel search scales.
+#
+# usage: time_to_depth.py [binary] [milliseconds]
+
+import subprocess
+import sys
+
+positions = [
+  "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+  "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+  "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+  "2r2rk1/pbq1bppp/8/8/2p1N3/P1Bn2P1/2Q2PBP/1R3RK1 w - - 4 24",
+]
+thread_counts = [1, 2, 4, 8]
+
+def depth_times(binary: str, threads: int, fen: str, milliseconds: int):
+  cmds = f"threads:{threads}\ngo:{fen}:{milliseconds}:v\n"
+  out = subprocess.run([binary], input=cmds, capture_output=True, text=True).stdout
+  times = {}
+  for line in out.split("\n"):
+    words = line.split(" ")
+    if words[0] == "depth":
+      times[int(words[1])] = int(words[2])
+  return times
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "./clce"
+milliseconds = int(sys.argv[2]) if len(sys.argv) > 2 else 10000
+
+results = {threads: {} for threads in thread_counts}
+for threads in thread_counts:
+  for fen in positions:
+    for depth,ms in depth_times(binary, threads, fen, milliseconds).items():
+      results[threads].setdefault(depth, []).append(ms)
+
+# only compare depths that every thread count reached in every position
+depths = sorted(set.intersection(*(set(d for d,t in r.items() if len(t) == len(positions))
+    for r in results.values())))
+print("depth " + " ".join(f"{threads:>8}T" for threads in thread_counts))
+for depth in depths:
+  row = [sum(results[threads][depth]) / len(positions) for threads in thread_counts]
+  print(f"{depth:5} " + " ".join(f"{ms:8.0f}ms" for ms in row))
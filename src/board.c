@@ -6,14 +6,137 @@
 
 #include <stdio.h>
 #include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define SHIFT(v, s) ((s) < 0 ? (v) >> -(s) : (v) << (s))
 
+/* castling rights lost when a piece moves from or to each square */
+static const BoardFlags castle_revoke_flags[64] = {
+  [0]  = BOARD_FLAG_WHITE_CASTLE_QUEEN,
+  [4]  = BOARD_FLAG_WHITE_CASTLE_KING | BOARD_FLAG_WHITE_CASTLE_QUEEN,
+  [7]  = BOARD_FLAG_WHITE_CASTLE_KING,
+  [56] = BOARD_FLAG_BLACK_CASTLE_QUEEN,
+  [60] = BOARD_FLAG_BLACK_CASTLE_KING | BOARD_FLAG_BLACK_CASTLE_QUEEN,
+  [63] = BOARD_FLAG_BLACK_CASTLE_KING,
+};
+
+/* rook origin and destination for a castling king destination */
+static int
+castle_rook_squares(int king_dest, int *rook_origin, int *rook_dest)
+{
+  switch(king_dest) {
+  case 2:
+    *rook_origin = 0;
+    *rook_dest = 3;
+    return 1;
+  case 6:
+    *rook_origin = 7;
+    *rook_dest = 5;
+    return 1;
+  case 58:
+    *rook_origin = 56;
+    *rook_dest = 59;
+    return 1;
+  case 62:
+    *rook_origin = 63;
+    *rook_dest = 61;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Restrictions on the destination of each piece that keep the king safe,
+ * computed once per position before any move is generated.
+ */
+struct legal_masks {
+  Bitboard check_mask; /* destinations that resolve check */
+  Bitboard pinned;
+  Bitboard pin_rays[64]; /* only valid for pinned squares */
+};
+
+static inline Bitboard
+pawn_attacks(Bitboard pawns, int col)
+{
+  int forward;
+  forward = col ? 8 : -8;
+  return (SHIFT(pawns, forward + 1) & 0xfefefefefefefefe)
+    | (SHIFT(pawns, forward - 1) & 0x7f7f7f7f7f7f7f7f);
+}
+
+static Bitboard
+squares_between(int a, int b)
+{
+  if (get_rook_attack_set(a, 0) & set_bit(b))
+    return get_rook_attack_set(a, set_bit(b)) & get_rook_attack_set(b, set_bit(a));
+  if (get_bishop_attack_set(a, 0) & set_bit(b))
+    return get_bishop_attack_set(a, set_bit(b)) & get_bishop_attack_set(b, set_bit(a));
+  return 0;
+}
+
+Bitboard
+find_attackers(struct position *pos, int square, Bitboard occupied)
+{
+  Bitboard *type_bitboards, *color_bitboards;
+  type_bitboards = pos->type_bitboards;
+  color_bitboards = pos->color_bitboards;
+  return (pawn_attacks(set_bit(square), COLOR_WHITE)
+      & type_bitboards[PIECE_TYPE_PAWN] & color_bitboards[COLOR_BLACK])
+    | (pawn_attacks(set_bit(square), COLOR_BLACK)
+      & type_bitboards[PIECE_TYPE_PAWN] & color_bitboards[COLOR_WHITE])
+    | (knight_attack_table[square] & type_bitboards[PIECE_TYPE_KNIGHT])
+    | (king_attack_table[square] & type_bitboards[PIECE_TYPE_KING])
+    | (get_bishop_attack_set(square, occupied)
+      & (type_bitboards[PIECE_TYPE_BISHOP] | type_bitboards[PIECE_TYPE_QUEEN]))
+    | (get_rook_attack_set(square, occupied)
+      & (type_bitboards[PIECE_TYPE_ROOK] | type_bitboards[PIECE_TYPE_QUEEN]));
+}
+
+/* returns the number of pieces giving check */
+static int
+find_legal_masks(struct position *pos, int col, int king_sq, struct legal_masks *masks)
+{
+  Bitboard their_all, all, checkers, snipers, between;
+  int sniper_sq;
+  their_all = pos->color_bitboards[!col];
+  all = pos->color_bitboards[0] | pos->color_bitboards[1];
+
+  checkers = find_attackers(pos, king_sq, all) & their_all;
+  if (checkers == 0)
+    masks->check_mask = ~(Bitboard)0;
+  else if ((checkers & (checkers - 1)) == 0)
+    masks->check_mask = checkers | squares_between(king_sq, lss(checkers));
+  else
+    masks->check_mask = 0;
+
+  /* sliders that would attack the king if only their own pieces blocked */
+  masks->pinned = 0;
+  snipers
+    = (get_rook_attack_set(king_sq, their_all)
+      & (pos->type_bitboards[PIECE_TYPE_ROOK] | pos->type_bitboards[PIECE_TYPE_QUEEN]))
+    | (get_bishop_attack_set(king_sq, their_all)
+      & (pos->type_bitboards[PIECE_TYPE_BISHOP] | pos->type_bitboards[PIECE_TYPE_QUEEN]));
+  snipers &= their_all & ~checkers;
+  while (snipers) {
+    sniper_sq = pop_lss(&snipers);
+    between = squares_between(king_sq, sniper_sq);
+    if (count_bits(between & all) != 1)
+      continue;
+    masks->pinned |= between & all;
+    masks->pin_rays[lss(between & all)] = between | set_bit(sniper_sq);
+  }
+  return count_bits(checkers);
+}
+
 static Move *
-generate_pawn_moves(struct board *board, Move *moves, int gen_flags)
+generate_pawn_moves(struct board *board, Move *moves, int gen_flags,
+    Bitboard my_pawns, Bitboard dest_mask)
 {
   struct position *pos;
-  Bitboard skip_rank, no_promote_ranks, promote_rank, my_pawns, their_all, empty;
+  Bitboard skip_rank, no_promote_ranks, promote_rank, their_all, empty;
   Bitboard move_1, move_2;
   int col, forward, origin, dest;
   pos = board_position(board);
@@ -22,13 +145,15 @@ generate_pawn_moves(struct board *board, Move *moves, int gen_flags)
   skip_rank        = col ? 0x0000000000ff0000 : 0x0000ff0000000000;
   no_promote_ranks = col ? 0x0000ffffffffffff : 0xffffffffffff0000;
   promote_rank     = col ? 0x00ff000000000000 : 0x000000000000ff00;
-  my_pawns = pos->type_bitboards[PIECE_TYPE_PAWN] & pos->color_bitboards[col];
   their_all = pos->color_bitboards[!col];
   empty = ~(pos->color_bitboards[0] | pos->color_bitboards[1]);
 
   /* regular move 1/2 */
   move_1 = SHIFT(my_pawns & no_promote_ranks, forward) & empty;
-  move_2 = SHIFT(move_1 & skip_rank, forward) & empty;
+  move_2 = SHIFT(move_1 & skip_rank, forward) & empty & dest_mask;
+  move_1 &= dest_mask;
+  if ( (gen_flags & GEN_FLAG_QUIETS) == 0)
+    move_1 = move_2 = 0;
   while (move_1) {
     dest = pop_lss(&move_1);
     origin = dest - forward;
@@ -41,31 +166,20 @@ generate_pawn_moves(struct board *board, Move *moves, int gen_flags)
   }
   if (gen_flags & GEN_FLAG_CAPTURES) {
     /* regular capture left/right */
-    move_1 = SHIFT(my_pawns & no_promote_ranks, forward + 1) & 0xfefefefefefefefe & their_all;
+    move_1 = SHIFT(my_pawns & no_promote_ranks, forward + 1) & 0xfefefefefefefefe & their_all & dest_mask;
     while (move_1) {
       dest = pop_lss(&move_1);
       origin = dest - (forward + 1);
       *moves++ = basic_move(origin, dest);
     }
-    move_1 = SHIFT(my_pawns & no_promote_ranks, forward - 1) & 0x7f7f7f7f7f7f7f7f & their_all;
+    move_1 = SHIFT(my_pawns & no_promote_ranks, forward - 1) & 0x7f7f7f7f7f7f7f7f & their_all & dest_mask;
     while (move_1) {
       dest = pop_lss(&move_1);
       origin = dest - (forward - 1);
       *moves++ = basic_move(origin, dest);
     }
-    /* en passant */
-    if (pos->en_passant_square >= 0) {
-      dest = pos->en_passant_square;
-      move_1
-        = ((SHIFT(set_bit(dest), -forward + 1) & 0xfefefefefefefefe)
-        | (SHIFT(set_bit(dest), -forward - 1) & 0x7f7f7f7f7f7f7f7f)) & my_pawns;
-      while (move_1) {
-        origin = pop_lss(&move_1);
-        *moves++ = en_passant_move(origin, dest);
-      }
-    }
     /* promotion */
-    move_1 = SHIFT(my_pawns & promote_rank, forward) & empty;
+    move_1 = SHIFT(my_pawns & promote_rank, forward) & empty & dest_mask;
     while (move_1) {
       dest = pop_lss(&move_1);
       origin = dest - forward;
@@ -74,7 +188,7 @@ generate_pawn_moves(struct board *board, Move *moves, int gen_flags)
       *moves++ = promote_move(origin, dest, PIECE_TYPE_ROOK);
       *moves++ = promote_move(origin, dest, PIECE_TYPE_QUEEN);
     }
-    move_1 = SHIFT(my_pawns & promote_rank, forward + 1) & 0xfefefefefefefefe & their_all;
+    move_1 = SHIFT(my_pawns & promote_rank, forward + 1) & 0xfefefefefefefefe & their_all & dest_mask;
     while (move_1) {
       dest = pop_lss(&move_1);
       origin = dest - (forward + 1);
@@ -83,7 +197,7 @@ generate_pawn_moves(struct board *board, Move *moves, int gen_flags)
       *moves++ = promote_move(origin, dest, PIECE_TYPE_ROOK);
       *moves++ = promote_move(origin, dest, PIECE_TYPE_QUEEN);
     }
-    move_1 = SHIFT(my_pawns & promote_rank, forward - 1) & 0x7f7f7f7f7f7f7f7f & their_all;
+    move_1 = SHIFT(my_pawns & promote_rank, forward - 1) & 0x7f7f7f7f7f7f7f7f & their_all & dest_mask;
     while (move_1) {
       dest = pop_lss(&move_1);
       origin = dest - (forward - 1);
@@ -96,20 +210,71 @@ generate_pawn_moves(struct board *board, Move *moves, int gen_flags)
   return moves;
 }
 
+/*
+ * En passant removes two pieces from one rank, which pin masks cannot
+ * describe, so test each capture against the resulting occupancy directly.
+ */
 static Move *
-generate_knight_moves(struct board *board, Move *moves, int gen_flags)
+generate_en_passant_moves(struct board *board, Move *moves, int king_sq)
 {
   struct position *pos;
-  uint64_t knights, attacks;
+  Bitboard candidates, all;
+  int col, forward, origin, dest, captured;
+  pos = board_position(board);
+  col = board_turn(board);
+  if (pos->en_passant_square < 0)
+    return moves;
+  forward = col ? 8 : -8;
+  dest = pos->en_passant_square;
+  captured = dest - forward;
+  candidates
+    = pawn_attacks(set_bit(dest), !col)
+    & pos->type_bitboards[PIECE_TYPE_PAWN] & pos->color_bitboards[col];
+  while (candidates) {
+    origin = pop_lss(&candidates);
+    all = pos->color_bitboards[0] | pos->color_bitboards[1];
+    all ^= set_bit(origin) | set_bit(captured) | set_bit(dest);
+    if (find_attackers(pos, king_sq, all) & pos->color_bitboards[!col] & ~set_bit(captured))
+      continue;
+    *moves++ = en_passant_move(origin, dest);
+  }
+  return moves;
+}
+
+static Move *
+generate_piece_moves(struct board *board, Move *moves, int gen_flags,
+    int piece_type, const struct legal_masks *masks)
+{
+  struct position *pos;
+  uint64_t pieces, attacks, all;
   int col, origin, dest;
   pos = board_position(board);
   col = board_turn(board);
-  knights = pos->type_bitboards[PIECE_TYPE_KNIGHT] & pos->color_bitboards[col];
-  while (knights) {
-    origin = pop_lss(&knights);
-    attacks = knight_attack_table[origin] & ~pos->color_bitboards[col];
+  all = pos->color_bitboards[0] | pos->color_bitboards[1];
+  pieces = pos->type_bitboards[piece_type] & pos->color_bitboards[col];
+  while (pieces) {
+    origin = pop_lss(&pieces);
+    switch (piece_type) {
+    case PIECE_TYPE_KNIGHT:
+      attacks = knight_attack_table[origin];
+      break;
+    case PIECE_TYPE_BISHOP:
+      attacks = get_bishop_attack_set(origin, all);
+      break;
+    case PIECE_TYPE_ROOK:
+      attacks = get_rook_attack_set(origin, all);
+      break;
+    default:
+      attacks = get_rook_attack_set(origin, all) | get_bishop_attack_set(origin, all);
+      break;
+    }
+    attacks &= ~pos->color_bitboards[col] & masks->check_mask;
+    if (masks->pinned & set_bit(origin))
+      attacks &= masks->pin_rays[origin];
     if ( (gen_flags & GEN_FLAG_CAPTURES) == 0)
       attacks &= ~pos->color_bitboards[!col];
+    if ( (gen_flags & GEN_FLAG_QUIETS) == 0)
+      attacks &= pos->color_bitboards[!col];
     while (attacks) {
       dest = pop_lss(&attacks);
       *moves++ = basic_move(origin, dest);
@@ -118,110 +283,152 @@ generate_knight_moves(struct board *board, Move *moves, int gen_flags)
   return moves;
 }
 
+/* quiet generation includes every king move, captures included */
 static Move *
-generate_king_moves(struct board *board, Move *moves)
+generate_king_moves(struct board *board, Move *moves, int gen_flags,
+    int king_sq, int in_check)
 {
   struct position *pos;
-  uint64_t king, attacks;
-  int col, origin, dest;
+  uint64_t attacks, all;
+  int col, dest;
   pos = board_position(board);
   col = board_turn(board);
-  king = pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[col];
-  assert(king);
-  origin = lss(king);
-  attacks = king_attack_table[origin] & ~pos->color_bitboards[col];
+  all = pos->color_bitboards[0] | pos->color_bitboards[1];
+  attacks = king_attack_table[king_sq] & ~pos->color_bitboards[col];
+  if ( (gen_flags & GEN_FLAG_QUIETS) == 0)
+    attacks &= (gen_flags & GEN_FLAG_CAPTURES) ? pos->color_bitboards[!col] : 0;
   while (attacks) {
     dest = pop_lss(&attacks);
-    *moves++ = basic_move(origin, dest);
+    /* the king must not be able to hide behind itself from a slider */
+    if (find_attackers(pos, dest, all ^ set_bit(king_sq)) & pos->color_bitboards[!col])
+      continue;
+    *moves++ = basic_move(king_sq, dest);
   }
+  if (in_check || (gen_flags & GEN_FLAG_QUIETS) == 0)
+    return moves;
   /* castling */
   if ( (pos->flags & KING_CASTLE_BOARD_FLAG(col)) == 0
-  &&   ((pos->color_bitboards[0] | pos->color_bitboards[1]) & KING_CASTLE_GAP(col)) == 0
-  &&   (pos->attack_sets[!col] & KING_CASTLE_CHECK_SQUARES(col)) == 0)
+  &&   (all & KING_CASTLE_GAP(col)) == 0
+  &&   (board_attack_set(board, !col) & KING_CASTLE_CHECK_SQUARES(col)) == 0)
       *moves++ = castle_move(col, 1);
   if ( (pos->flags & QUEEN_CASTLE_BOARD_FLAG(col)) == 0
-  &&   ((pos->color_bitboards[0] | pos->color_bitboards[1]) & QUEEN_CASTLE_GAP(col)) == 0
-  &&   (pos->attack_sets[!col] & QUEEN_CASTLE_CHECK_SQUARES(col)) == 0)
+  &&   (all & QUEEN_CASTLE_GAP(col)) == 0
+  &&   (board_attack_set(board, !col) & QUEEN_CASTLE_CHECK_SQUARES(col)) == 0)
       *moves++ = castle_move(col, 0);
   return moves;
 }
 
-static Move *
-generate_bishop_moves(struct board *board, Move *moves, int gen_flags)
+/*
+ * Squares attacked by the sliding pieces of one color, including squares
+ * occupied by that color's own pieces so that any change of occupancy along
+ * a ray shows up in the set.
+ */
+static uint64_t
+find_slider_attack_set(uint64_t *color_bitboards, uint64_t *type_bitboards, int col)
 {
-  struct position *pos;
-  uint64_t bishops, attacks;
-  int col, origin, dest;
-  pos = board_position(board);
-  col = board_turn(board);
-  bishops = pos->type_bitboards[PIECE_TYPE_BISHOP] & pos->color_bitboards[col];
-  while (bishops) {
-    origin = pop_lss(&bishops);
-    attacks
-      = get_bishop_attack_set(origin, pos->color_bitboards[0] | pos->color_bitboards[1])
-      & ~pos->color_bitboards[col];
-    if ( (gen_flags & GEN_FLAG_CAPTURES) == 0)
-      attacks &= ~pos->color_bitboards[!col];
-    while (attacks) {
-      dest = pop_lss(&attacks);
-      *moves++ = basic_move(origin, dest);
-    }
+  uint64_t pieces, set;
+  int origin;
+
+  set = 0;
+
+  /* bishop-like */
+  pieces
+    = (type_bitboards[PIECE_TYPE_BISHOP]
+      | type_bitboards[PIECE_TYPE_QUEEN])
+    & color_bitboards[col];
+  while (pieces) {
+    origin = pop_lss(&pieces);
+    set |= get_bishop_attack_set(origin, color_bitboards[0] | color_bitboards[1]);
   }
-  return moves;
+  /* rook-like */
+  pieces
+    = (type_bitboards[PIECE_TYPE_ROOK]
+      | type_bitboards[PIECE_TYPE_QUEEN])
+    & color_bitboards[col];
+  while (pieces) {
+    origin = pop_lss(&pieces);
+    set |= get_rook_attack_set(origin, color_bitboards[0] | color_bitboards[1]);
+  }
+
+  return set;
 }
 
-static Move *
-generate_rook_moves(struct board *board, Move *moves, int gen_flags)
+#if defined(__x86_64__)
+/*
+ * Kogge-Stone occluded fill of four rays at once, each lane shifting by
+ * its own amount. mask clears the squares a shift wraps around to.
+ */
+__attribute__((target("avx2"))) static __m256i
+fill_left_avx2(__m256i gen, __m256i empty, __m256i shift, __m256i mask)
 {
-  struct position *pos;
-  uint64_t rooks, attacks;
-  int col, origin, dest;
-  pos = board_position(board);
-  col = board_turn(board);
-  rooks = pos->type_bitboards[PIECE_TYPE_ROOK] & pos->color_bitboards[col];
-  while (rooks) {
-    origin = pop_lss(&rooks);
-    attacks
-      = get_rook_attack_set(origin, pos->color_bitboards[0] | pos->color_bitboards[1])
-      & ~pos->color_bitboards[col];
-    if ( (gen_flags & GEN_FLAG_CAPTURES) == 0)
-      attacks &= ~pos->color_bitboards[!col];
-    while (attacks) {
-      dest = pop_lss(&attacks);
-      *moves++ = basic_move(origin, dest);
-    }
-  }
-  return moves;
+  empty = _mm256_and_si256(empty, mask);
+  gen = _mm256_or_si256(gen, _mm256_and_si256(empty, _mm256_sllv_epi64(gen, shift)));
+  empty = _mm256_and_si256(empty, _mm256_sllv_epi64(empty, shift));
+  shift = _mm256_add_epi64(shift, shift);
+  gen = _mm256_or_si256(gen, _mm256_and_si256(empty, _mm256_sllv_epi64(gen, shift)));
+  empty = _mm256_and_si256(empty, _mm256_sllv_epi64(empty, shift));
+  shift = _mm256_add_epi64(shift, shift);
+  gen = _mm256_or_si256(gen, _mm256_and_si256(empty, _mm256_sllv_epi64(gen, shift)));
+  shift = _mm256_srli_epi64(shift, 2);
+  return _mm256_and_si256(_mm256_sllv_epi64(gen, shift), mask);
 }
-
-static Move *
-generate_queen_moves(struct board *board, Move *moves, int gen_flags)
+__attribute__((target("avx2"))) static __m256i
+fill_right_avx2(__m256i gen, __m256i empty, __m256i shift, __m256i mask)
 {
-  struct position *pos;
-  uint64_t queens, attacks;
-  int col, origin, dest;
-  pos = board_position(board);
-  col = board_turn(board);
-  queens = pos->type_bitboards[PIECE_TYPE_QUEEN] & pos->color_bitboards[col];
-  while (queens) {
-    origin = pop_lss(&queens);
-    attacks
-      = (get_rook_attack_set(origin, pos->color_bitboards[0] | pos->color_bitboards[1])
-      | get_bishop_attack_set(origin, pos->color_bitboards[0] | pos->color_bitboards[1]))
-      & ~pos->color_bitboards[col];
-    if ( (gen_flags & GEN_FLAG_CAPTURES) == 0)
-      attacks &= ~pos->color_bitboards[!col];
-    while (attacks) {
-      dest = pop_lss(&attacks);
-      *moves++ = basic_move(origin, dest);
-    }
-  }
-  return moves;
+  empty = _mm256_and_si256(empty, mask);
+  gen = _mm256_or_si256(gen, _mm256_and_si256(empty, _mm256_srlv_epi64(gen, shift)));
+  empty = _mm256_and_si256(empty, _mm256_srlv_epi64(empty, shift));
+  shift = _mm256_add_epi64(shift, shift);
+  gen = _mm256_or_si256(gen, _mm256_and_si256(empty, _mm256_srlv_epi64(gen, shift)));
+  empty = _mm256_and_si256(empty, _mm256_srlv_epi64(empty, shift));
+  shift = _mm256_add_epi64(shift, shift);
+  gen = _mm256_or_si256(gen, _mm256_and_si256(empty, _mm256_srlv_epi64(gen, shift)));
+  shift = _mm256_srli_epi64(shift, 2);
+  return _mm256_and_si256(_mm256_srlv_epi64(gen, shift), mask);
 }
 
+/*
+ * Slider attack sets of both colors together, the same sets as
+ * find_slider_attack_set(). Lanes hold black and white rook-likes for
+ * two rook directions, or bishop-likes for two bishop directions, so
+ * four fills cover all eight directions of both colors.
+ */
+__attribute__((target("avx2"))) static void
+find_slider_attack_sets_avx2(uint64_t *color_bitboards, uint64_t *type_bitboards,
+    uint64_t *sets)
+{
+  const int64_t not_file_a = 0xfefefefefefefefe, not_file_h = 0x7f7f7f7f7f7f7f7f;
+  __m256i rooks, bishops, empty, set;
+  uint64_t rook_likes, bishop_likes;
+  rook_likes = type_bitboards[PIECE_TYPE_ROOK] | type_bitboards[PIECE_TYPE_QUEEN];
+  bishop_likes = type_bitboards[PIECE_TYPE_BISHOP] | type_bitboards[PIECE_TYPE_QUEEN];
+  rooks = _mm256_setr_epi64x(rook_likes & color_bitboards[0],
+      rook_likes & color_bitboards[1], rook_likes & color_bitboards[0],
+      rook_likes & color_bitboards[1]);
+  bishops = _mm256_setr_epi64x(bishop_likes & color_bitboards[0],
+      bishop_likes & color_bitboards[1], bishop_likes & color_bitboards[0],
+      bishop_likes & color_bitboards[1]);
+  empty = _mm256_set1_epi64x(~(color_bitboards[0] | color_bitboards[1]));
+  /* north, east */
+  set = fill_left_avx2(rooks, empty, _mm256_setr_epi64x(8, 8, 1, 1),
+      _mm256_setr_epi64x(-1, -1, not_file_a, not_file_a));
+  /* south, west */
+  set = _mm256_or_si256(set, fill_right_avx2(rooks, empty, _mm256_setr_epi64x(8, 8, 1, 1),
+      _mm256_setr_epi64x(-1, -1, not_file_h, not_file_h)));
+  /* north east, north west */
+  set = _mm256_or_si256(set, fill_left_avx2(bishops, empty, _mm256_setr_epi64x(9, 9, 7, 7),
+      _mm256_setr_epi64x(not_file_a, not_file_a, not_file_h, not_file_h)));
+  /* south west, south east */
+  set = _mm256_or_si256(set, fill_right_avx2(bishops, empty, _mm256_setr_epi64x(9, 9, 7, 7),
+      _mm256_setr_epi64x(not_file_h, not_file_h, not_file_a, not_file_a)));
+  set = _mm256_or_si256(set, _mm256_permute4x64_epi64(set, 0x4e));
+  sets[0] = _mm256_extract_epi64(set, 0);
+  sets[1] = _mm256_extract_epi64(set, 1);
+}
+#endif
 
 static uint64_t
-find_attack_set(uint64_t *color_bitboards, uint64_t *type_bitboards, int col)
+find_leaper_attack_set(uint64_t *color_bitboards, uint64_t *type_bitboards, int col)
 {
   uint64_t pieces, set;
   int origin, forward;
@@ -237,38 +444,42 @@ find_attack_set(uint64_t *color_bitboards, uint64_t *type_bitboards, int col)
   pieces = type_bitboards[PIECE_TYPE_KNIGHT] & color_bitboards[col];
   while (pieces) {
     origin = pop_lss(&pieces);
-    set |= knight_attack_table[origin] & ~color_bitboards[col];
-  }
-  /* bishop-like */
-  pieces
-    = (type_bitboards[PIECE_TYPE_BISHOP]
-      | type_bitboards[PIECE_TYPE_QUEEN])
-    & color_bitboards[col];
-  while (pieces) {
-    origin = pop_lss(&pieces);
-    set
-      |= get_bishop_attack_set(origin, color_bitboards[0] | color_bitboards[1])
-      & ~color_bitboards[col];
-  }
-  /* rook-like */
-  pieces
-    = (type_bitboards[PIECE_TYPE_ROOK]
-      | type_bitboards[PIECE_TYPE_QUEEN])
-    & color_bitboards[col];
-  while (pieces) {
-    origin = pop_lss(&pieces);
-    set
-      |= get_rook_attack_set(origin, color_bitboards[0] | color_bitboards[1])
-      & ~color_bitboards[col];
+    set |= knight_attack_table[origin];
   }
   /* king */
   pieces = type_bitboards[PIECE_TYPE_KING] & color_bitboards[col];
   origin = pop_lss(&pieces);
-  set |= king_attack_table[origin] & ~color_bitboards[col];
+  set |= king_attack_table[origin];
 
   return set;
 }
 
+void
+update_attack_set(struct position *pos, int col)
+{
+  if ((pos->attack_sets_valid & SLIDER_ATTACK_SET_VALID(col)) == 0) {
+#if defined(__x86_64__)
+    /* the fills cost the same for one color or both */
+    if (cpu_features & CPU_AVX2) {
+      find_slider_attack_sets_avx2(pos->color_bitboards, pos->type_bitboards,
+          pos->slider_attack_sets);
+      pos->attack_sets_valid |= SLIDER_ATTACK_SET_VALID(COLOR_WHITE)
+        | SLIDER_ATTACK_SET_VALID(COLOR_BLACK);
+    } else
+#endif
+    {
+      pos->slider_attack_sets[col]
+        = find_slider_attack_set(pos->color_bitboards, pos->type_bitboards, col);
+      pos->attack_sets_valid |= SLIDER_ATTACK_SET_VALID(col);
+    }
+  }
+  pos->attack_sets[col]
+    = (pos->slider_attack_sets[col]
+      | find_leaper_attack_set(pos->color_bitboards, pos->type_bitboards, col))
+    & ~pos->color_bitboards[col];
+  pos->attack_sets_valid |= ATTACK_SET_VALID(col);
+}
+
 int
 create_board(struct board *board, const char *fen)
 {
@@ -277,7 +488,7 @@ create_board(struct board *board, const char *fen)
   int piece_type, piece_color;
   unsigned char c;
   memset(board, 0, sizeof(struct board));
-  pos = &board->stack[0];
+  pos = board_position(board);
   r = 7;
   f = 0;
   while (!(r == 0 && f == 8)) {
@@ -411,28 +622,87 @@ create_board(struct board *board, const char *fen)
       return 1;
     }
   }
-  pos->attack_sets[0] = find_attack_set(pos->color_bitboards, pos->type_bitboards, 0);
-  pos->attack_sets[1] = find_attack_set(pos->color_bitboards, pos->type_bitboards, 1);
+  init_position_evaluation(pos);
   return 0;
 }
 
+/*
+ * Adds (delta 1) or removes (delta -1) a piece from the evaluation sums,
+ * and records the change for the network accumulator if there is one.
+ */
+static inline void
+update_piece_score(struct board *board, int col, int piece_type, int square, int delta)
+{
+  struct position *pos;
+  struct nnue_accumulator *acc;
+  struct nnue_dirty_piece *dirty;
+  int index, sign;
+  pos = board_position(board);
+  if (board->nnue) {
+    acc = &board->nnue[board->ply];
+    assert(acc->dirty_count < sizeof(acc->dirty) / sizeof(acc->dirty[0]));
+    dirty = &acc->dirty[acc->dirty_count++];
+    dirty->color = col;
+    dirty->piece_type = piece_type;
+    dirty->square = square;
+    dirty->delta = delta;
+    if (piece_type == PIECE_TYPE_KING)
+      acc->refresh[col] = 1;
+  }
+  index = psq_index(col, square);
+  sign = col == COLOR_WHITE ? delta : -delta;
+  pos->mg_score += sign * (piece_values[piece_type] + psq_mg_tables[piece_type][index]);
+  pos->eg_score += sign * (piece_values[piece_type] + psq_eg_tables[piece_type][index]);
+  pos->phase += delta * phase_weights[piece_type];
+}
+
 void
 board_push(struct board *board, Move move)
 {
-  Bitboard their_pawns;
+  Bitboard their_pawns, changed, sliders, old_sliders[2];
   struct position *pos;
+  struct undo *undo;
   int col, forward, origin, dest, piece_type;
   int castle_origin, castle_dest;
-  int other_piece;
+  int other_piece, i;
+  BoardFlags castle_flags;
 
-  board->stack[board->ply + 1] = board->stack[board->ply];
-  board->ply++;
+  assert(board->ply + 1 < MAX_SEARCH_PLY);
   pos = board_position(board);
+  undo = &board->undo_stack[board->ply];
+  undo->pawn_hash = pos->pawn_hash;
+  undo->non_pawn_hash = pos->non_pawn_hash;
+  undo->flags = pos->flags;
+  undo->en_passant_square = pos->en_passant_square;
+  undo->halfmove_clock = pos->halfmove_clock;
+  undo->mg_score = pos->mg_score;
+  undo->eg_score = pos->eg_score;
+  undo->phase = pos->phase;
+  undo->captured_piece = PIECE_TYPE_NONE;
+  board->repetition_filter[board_hash(board) & (REPETITION_FILTER_SIZE - 1)]++;
+  undo->attack_sets[0] = pos->attack_sets[0];
+  undo->attack_sets[1] = pos->attack_sets[1];
+  undo->slider_attack_sets[0] = pos->slider_attack_sets[0];
+  undo->slider_attack_sets[1] = pos->slider_attack_sets[1];
+  undo->attack_sets_valid = pos->attack_sets_valid;
+  board->ply++;
+  if (board->nnue) {
+    board->nnue[board->ply].computed[0] = board->nnue[board->ply].computed[1] = 0;
+    board->nnue[board->ply].refresh[0] = board->nnue[board->ply].refresh[1] = 0;
+    board->nnue[board->ply].dirty_count = 0;
+  }
   col = board_turn(board);
   forward = col ? 8 : -8;
   origin = move_origin(move);
   dest = move_dest(move);
   piece_type = get_piece_type(pos->mailbox, origin);
+  changed = set_bit(origin) | set_bit(dest);
+  sliders
+    = pos->type_bitboards[PIECE_TYPE_BISHOP]
+    | pos->type_bitboards[PIECE_TYPE_ROOK]
+    | pos->type_bitboards[PIECE_TYPE_QUEEN];
+  old_sliders[COLOR_BLACK] = sliders & pos->color_bitboards[COLOR_BLACK];
+  old_sliders[COLOR_WHITE] = sliders & pos->color_bitboards[COLOR_WHITE];
 
   board->fullmove_clock++;
   pos->halfmove_clock++;
@@ -442,8 +712,10 @@ board_push(struct board *board, Move move)
     pos->halfmove_clock = 0;
     /* clear captured piece */
     other_piece = get_piece_type(pos->mailbox, dest);
+    undo->captured_piece = other_piece;
     pos->type_bitboards[other_piece] ^= set_bit(dest);
     pos->color_bitboards[!col] ^= set_bit(dest);
+    update_piece_score(board, !col, other_piece, dest, -1);
     if (other_piece == PIECE_TYPE_PAWN)
       pos->pawn_hash
         ^= get_zobrist_piece_number(!col, PIECE_TYPE_PAWN, dest);
@@ -454,12 +726,14 @@ board_push(struct board *board, Move move)
 
   /* move piece */
   if (pos->en_passant_square >= 0) {
-    pos->pawn_hash ^= zobrist_en_passant_numbers[pos->en_passant_square & 0x07];
+    pos->non_pawn_hash ^= zobrist_en_passant_numbers[pos->en_passant_square & 0x07];
     pos->en_passant_square = -1;
   }
   pos->type_bitboards[piece_type] ^= set_bit(origin) | set_bit(dest);
   pos->color_bitboards[col] ^= set_bit(origin) | set_bit(dest);
   set_piece_type(pos->mailbox, dest, piece_type);
+  update_piece_score(board, col, piece_type, origin, -1);
+  update_piece_score(board, col, piece_type, dest, 1);
   if (piece_type == PIECE_TYPE_PAWN) {
     pos->pawn_hash ^= get_zobrist_piece_number(col, PIECE_TYPE_PAWN, origin);
     pos->pawn_hash ^= get_zobrist_piece_number(col, PIECE_TYPE_PAWN, dest);
@@ -476,7 +750,7 @@ board_push(struct board *board, Move move)
       if ((set_bit(dest) << 1) & 0xfefefefefefefefe & their_pawns
           || (set_bit(dest) >> 1) & 0x7f7f7f7f7f7f7f7f & their_pawns) {
         pos->en_passant_square = origin + forward;
-        pos->pawn_hash ^= zobrist_en_passant_numbers[pos->en_passant_square & 0x07];
+        pos->non_pawn_hash ^= zobrist_en_passant_numbers[pos->en_passant_square & 0x07];
       }
     } else if (move_special_type(move) == SPECIAL_MOVE_PROMOTE) {
       other_piece = move_promote_piece(move);
@@ -485,75 +759,52 @@ board_push(struct board *board, Move move)
       pos->pawn_hash ^= get_zobrist_piece_number(col, PIECE_TYPE_PAWN, dest);
       pos->type_bitboards[other_piece] ^= set_bit(dest);
       pos->non_pawn_hash ^= get_zobrist_piece_number(col, other_piece, dest);
+      update_piece_score(board, col, PIECE_TYPE_PAWN, dest, -1);
+      update_piece_score(board, col, other_piece, dest, 1);
     } else if (move_special_type(move) == SPECIAL_MOVE_EN_PASSANT) {
       pos->type_bitboards[PIECE_TYPE_PAWN] ^= set_bit(dest - forward);
       pos->color_bitboards[!col] ^= set_bit(dest - forward);
+      changed |= set_bit(dest - forward);
       pos->pawn_hash ^= get_zobrist_piece_number(!col, PIECE_TYPE_PAWN, dest - forward);
+      update_piece_score(board, !col, PIECE_TYPE_PAWN, dest - forward, -1);
     }
   }
 
-  if (piece_type == PIECE_TYPE_KING) {
-    if (col == COLOR_WHITE)
-      pos->flags |= BOARD_FLAG_WHITE_CASTLE_KING | BOARD_FLAG_WHITE_CASTLE_QUEEN;
-    else
-      pos->flags |= BOARD_FLAG_BLACK_CASTLE_KING | BOARD_FLAG_BLACK_CASTLE_QUEEN;
-  }
-  if (piece_type == PIECE_TYPE_ROOK) {
-    pos->non_pawn_hash ^= (pos->flags >> 1) & 0x0f;
-    switch(origin) {
-    case 0:
-      pos->flags |= BOARD_FLAG_WHITE_CASTLE_QUEEN;
-      break;
-    case 7:
-      pos->flags |= BOARD_FLAG_WHITE_CASTLE_KING;
-      break;
-    case 56:
-      pos->flags |= BOARD_FLAG_BLACK_CASTLE_QUEEN;
-      break;
-    case 63:
-      pos->flags |= BOARD_FLAG_BLACK_CASTLE_KING;
-      break;
-    }
-    pos->non_pawn_hash ^= (pos->flags >> 1) & 0x0f;
+  /* castling rights */
+  castle_flags = pos->flags | castle_revoke_flags[origin] | castle_revoke_flags[dest];
+  if (castle_flags != pos->flags) {
+    pos->non_pawn_hash ^= zobrist_castling_numbers[(pos->flags >> 1) & 0x0f];
+    pos->flags = castle_flags;
+    pos->non_pawn_hash ^= zobrist_castling_numbers[(pos->flags >> 1) & 0x0f];
   }
 
   /* castling */
-  if (move_special_type(move) == SPECIAL_MOVE_CASTLING) {
-    pos->non_pawn_hash ^= (pos->flags >> 1) & 0x0f;
-    pos->flags |= col
-      ? BOARD_FLAG_WHITE_CASTLE_KING | BOARD_FLAG_WHITE_CASTLE_QUEEN
-      : BOARD_FLAG_BLACK_CASTLE_KING | BOARD_FLAG_BLACK_CASTLE_QUEEN;
-    pos->non_pawn_hash ^= (pos->flags >> 1) & 0x0f;
-    switch(dest) {
-    case 2:
-      castle_origin = 0;
-      castle_dest = 3;
-      break;
-    case 6:
-      castle_origin = 7;
-      castle_dest = 5;
-      break;
-    case 58:
-      castle_origin = 56;
-      castle_dest = 59;
-      break;
-    case 62:
-      castle_origin = 63;
-      castle_dest = 61;
-      break;
-    default:
-      goto no_castle;
-    }
+  if (move_special_type(move) == SPECIAL_MOVE_CASTLING
+  &&  castle_rook_squares(dest, &castle_origin, &castle_dest)) {
     set_piece_type(pos->mailbox, castle_dest, PIECE_TYPE_ROOK);
+    changed |= set_bit(castle_origin) | set_bit(castle_dest);
     pos->color_bitboards[col]          ^= set_bit(castle_origin) | set_bit(castle_dest);
     pos->type_bitboards[PIECE_TYPE_ROOK] ^= set_bit(castle_origin) | set_bit(castle_dest);
     pos->non_pawn_hash ^= get_zobrist_piece_number(col, PIECE_TYPE_ROOK, castle_origin);
     pos->non_pawn_hash ^= get_zobrist_piece_number(col, PIECE_TYPE_ROOK, castle_dest);
+    update_piece_score(board, col, PIECE_TYPE_ROOK, castle_origin, -1);
+    update_piece_score(board, col, PIECE_TYPE_ROOK, castle_dest, 1);
   }
-no_castle:
 
-  pos->attack_sets[0] = find_attack_set(pos->color_bitboards, pos->type_bitboards, 0);
-  pos->attack_sets[1] = find_attack_set(pos->color_bitboards, pos->type_bitboards, 1);
+  /*
+   * A color's slider attacks only change when one of its sliders moved, was
+   * captured or was promoted to, or when occupancy changed somewhere along
+   * one of its rays. Otherwise they carry over from the parent position.
+   */
+  sliders
+    = pos->type_bitboards[PIECE_TYPE_BISHOP]
+    | pos->type_bitboards[PIECE_TYPE_ROOK]
+    | pos->type_bitboards[PIECE_TYPE_QUEEN];
+  for (i = 0; i < 2; i++)
+    if (changed & (pos->slider_attack_sets[i] | old_sliders[i]
+        | (sliders & pos->color_bitboards[i])))
+      pos->attack_sets_valid &= ~SLIDER_ATTACK_SET_VALID(i);
+  pos->attack_sets_valid &= ~(ATTACK_SET_VALID(COLOR_WHITE) | ATTACK_SET_VALID(COLOR_BLACK));
   pos->flags ^= BOARD_FLAG_WHITE_TO_PLAY;
   pos->non_pawn_hash ^= zobrist_black_number;
 }
@@ -561,63 +812,364 @@ no_castle:
 void
 board_pop(struct board *board, Move move)
 {
+  struct position *pos;
+  struct undo *undo;
+  int col, forward, origin, dest, piece_type;
+  int castle_origin, castle_dest;
   assert(board->ply > 0);
   assert(board->fullmove_clock > 0);
   board->ply--;
   board->fullmove_clock--;
+  pos = board_position(board);
+  undo = &board->undo_stack[board->ply];
+  pos->flags = undo->flags;
+  col = board_turn(board);
+  forward = col ? 8 : -8;
+  origin = move_origin(move);
+  dest = move_dest(move);
+  piece_type = get_piece_type(pos->mailbox, dest);
+
+  /* move piece back */
+  if (move_special_type(move) == SPECIAL_MOVE_PROMOTE) {
+    pos->type_bitboards[piece_type] ^= set_bit(dest);
+    pos->type_bitboards[PIECE_TYPE_PAWN] ^= set_bit(dest);
+    piece_type = PIECE_TYPE_PAWN;
+  }
+  pos->type_bitboards[piece_type] ^= set_bit(origin) | set_bit(dest);
+  pos->color_bitboards[col] ^= set_bit(origin) | set_bit(dest);
+  set_piece_type(pos->mailbox, origin, piece_type);
+
+  /* restore captured piece */
+  if (undo->captured_piece != PIECE_TYPE_NONE) {
+    pos->type_bitboards[undo->captured_piece] ^= set_bit(dest);
+    pos->color_bitboards[!col] ^= set_bit(dest);
+    set_piece_type(pos->mailbox, dest, undo->captured_piece);
+  } else if (move_special_type(move) == SPECIAL_MOVE_EN_PASSANT) {
+    pos->type_bitboards[PIECE_TYPE_PAWN] ^= set_bit(dest - forward);
+    pos->color_bitboards[!col] ^= set_bit(dest - forward);
+    set_piece_type(pos->mailbox, dest - forward, PIECE_TYPE_PAWN);
+  } else if (move_special_type(move) == SPECIAL_MOVE_CASTLING
+         &&  castle_rook_squares(dest, &castle_origin, &castle_dest)) {
+    set_piece_type(pos->mailbox, castle_origin, PIECE_TYPE_ROOK);
+    pos->color_bitboards[col]          ^= set_bit(castle_origin) | set_bit(castle_dest);
+    pos->type_bitboards[PIECE_TYPE_ROOK] ^= set_bit(castle_origin) | set_bit(castle_dest);
+  }
+
+  pos->pawn_hash = undo->pawn_hash;
+  pos->non_pawn_hash = undo->non_pawn_hash;
+  pos->en_passant_square = undo->en_passant_square;
+  pos->halfmove_clock = undo->halfmove_clock;
+  pos->mg_score = undo->mg_score;
+  pos->eg_score = undo->eg_score;
+  pos->phase = undo->phase;
+  pos->attack_sets[0] = undo->attack_sets[0];
+  pos->attack_sets[1] = undo->attack_sets[1];
+  pos->slider_attack_sets[0] = undo->slider_attack_sets[0];
+  pos->slider_attack_sets[1] = undo->slider_attack_sets[1];
+  pos->attack_sets_valid = undo->attack_sets_valid;
+  board->repetition_filter[board_hash(board) & (REPETITION_FILTER_SIZE - 1)]--;
 }
 
+/*
+ * Passes the turn, for null move pruning. No piece moves, so the attack
+ * sets stay valid and the network has nothing to update.
+ */
+void
+board_push_null(struct board *board)
+{
+  struct position *pos;
+  struct undo *undo;
+  assert(board->ply + 1 < MAX_SEARCH_PLY);
+  assert(!board_in_check(board));
+  pos = board_position(board);
+  undo = &board->undo_stack[board->ply];
+  undo->pawn_hash = pos->pawn_hash;
+  undo->non_pawn_hash = pos->non_pawn_hash;
+  undo->flags = pos->flags;
+  undo->en_passant_square = pos->en_passant_square;
+  undo->halfmove_clock = pos->halfmove_clock;
+  board->repetition_filter[board_hash(board) & (REPETITION_FILTER_SIZE - 1)]++;
+  board->ply++;
+  board->fullmove_clock++;
+  if (board->nnue) {
+    board->nnue[board->ply].computed[0] = board->nnue[board->ply].computed[1] = 0;
+    board->nnue[board->ply].refresh[0] = board->nnue[board->ply].refresh[1] = 0;
+    board->nnue[board->ply].dirty_count = 0;
+  }
+  if (pos->en_passant_square >= 0) {
+    pos->non_pawn_hash ^= zobrist_en_passant_numbers[pos->en_passant_square & 0x07];
+    pos->en_passant_square = -1;
+  }
+  /* a repetition can not span the null move */
+  pos->halfmove_clock = 0;
+  pos->flags ^= BOARD_FLAG_WHITE_TO_PLAY;
+  pos->non_pawn_hash ^= zobrist_black_number;
+}
+
+void
+board_pop_null(struct board *board)
+{
+  struct position *pos;
+  struct undo *undo;
+  assert(board->ply > 0);
+  board->ply--;
+  board->fullmove_clock--;
+  pos = board_position(board);
+  undo = &board->undo_stack[board->ply];
+  pos->flags = undo->flags;
+  pos->pawn_hash = undo->pawn_hash;
+  pos->non_pawn_hash = undo->non_pawn_hash;
+  pos->en_passant_square = undo->en_passant_square;
+  pos->halfmove_clock = undo->halfmove_clock;
+  board->repetition_filter[board_hash(board) & (REPETITION_FILTER_SIZE - 1)]--;
+}
+
+/*
+ * Only positions since the last irreversible move with the same side to
+ * move can repeat, and the filter rules out most positions without
+ * looking at the stack at all.
+ */
 int
 board_is_repetition(struct board *board)
 {
   struct position *pos;
-  int i;
+  struct undo *undo;
+  int i, last;
   uint64_t pawn_hash, non_pawn_hash;
-  pos = &board->stack[board->ply];
+  pos = board_position(board);
+  if (board->repetition_filter[board_hash(board) & (REPETITION_FILTER_SIZE - 1)] == 0)
+    return 0;
   pawn_hash = pos->pawn_hash;
   non_pawn_hash = pos->non_pawn_hash;
-  for (i = board->ply - 1; i >= 0; i--) {
-    pos = &board->stack[i];
-    if (pos->pawn_hash == pawn_hash && pos->non_pawn_hash == non_pawn_hash)
+  last = board->ply - pos->halfmove_clock;
+  if (last < 0)
+    last = 0;
+  for (i = board->ply - 4; i >= last; i -= 2) {
+    undo = &board->undo_stack[i];
+    if (undo->pawn_hash == pawn_hash && undo->non_pawn_hash == non_pawn_hash)
       return 1;
   }
   return 0;
 }
 
+/* neither side can mate: no pawns, rooks or queens and at most one minor
+ * piece or only bishops on one square color */
+static int
+insufficient_material(struct position *pos)
+{
+  Bitboard bishops;
+  if (pos->type_bitboards[PIECE_TYPE_PAWN] | pos->type_bitboards[PIECE_TYPE_ROOK]
+  |   pos->type_bitboards[PIECE_TYPE_QUEEN])
+    return 0;
+  bishops = pos->type_bitboards[PIECE_TYPE_BISHOP];
+  if (count_bits(pos->type_bitboards[PIECE_TYPE_KNIGHT] | bishops) <= 1)
+    return 1;
+  return pos->type_bitboards[PIECE_TYPE_KNIGHT] == 0
+    && ((bishops & LIGHT_SQUARES) == 0 || (bishops & ~LIGHT_SQUARES) == 0);
+}
+
+/*
+ * Draws by repetition, the 50 move rule or insufficient material. A
+ * position in check is never a 50 move draw here since it may be mate.
+ */
+int
+board_is_draw(struct board *board)
+{
+  struct position *pos;
+  pos = board_position(board);
+  if (pos->halfmove_clock >= 100 && !board_in_check(board))
+    return 1;
+  return board_is_repetition(board) || insufficient_material(pos);
+}
+
+/* generates legal moves only */
 int
 board_moves(struct board *board, Move *moves, int gen_flags)
 {
-  struct position *pos, *new_pos;
-  int col, king_sq;
-  Move *base, *legal_moves;
+  struct legal_masks masks;
+  struct position *pos;
+  Bitboard my_pawns, pinned_pawns;
+  int col, king_sq, check_count, origin;
+  Move *base;
   pos = board_position(board);
   col = board_turn(board);
-  base = legal_moves = moves;
+  base = moves;
   king_sq = lss(pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[col]);
+  check_count = find_legal_masks(pos, col, king_sq, &masks);
 
-  moves = generate_pawn_moves(board, moves, gen_flags);
-  moves = generate_knight_moves(board, moves, gen_flags);
-  moves = generate_bishop_moves(board, moves, gen_flags);
-  moves = generate_rook_moves(board, moves, gen_flags);
-  moves = generate_queen_moves(board, moves, gen_flags);
-  moves = generate_king_moves(board, moves);
-  while (legal_moves != moves) {
-    if (!board_in_check(board)
-    &&  move_origin(*legal_moves) != king_sq
-    &&  (set_bit(move_origin(*legal_moves)) & pos->attack_sets[!col] ) == 0
-    &&  move_special_type(*legal_moves) != SPECIAL_MOVE_EN_PASSANT) {
-      legal_moves++;
-      continue;
+  /* in double check only the king can move */
+  if (check_count < 2) {
+    my_pawns = pos->type_bitboards[PIECE_TYPE_PAWN] & pos->color_bitboards[col];
+    pinned_pawns = my_pawns & masks.pinned;
+    moves = generate_pawn_moves(board, moves, gen_flags,
+        my_pawns & ~pinned_pawns, masks.check_mask);
+    while (pinned_pawns) {
+      origin = pop_lss(&pinned_pawns);
+      moves = generate_pawn_moves(board, moves, gen_flags,
+          set_bit(origin), masks.check_mask & masks.pin_rays[origin]);
     }
-    board_push(board, *legal_moves);
-    new_pos = board_position(board);
-    if (new_pos->attack_sets[!col]
-    &   new_pos->type_bitboards[PIECE_TYPE_KING]
-    &   new_pos->color_bitboards[col])
-      *legal_moves = *(--moves);
-    else
-      legal_moves++;
-    board_pop(board, *legal_moves);
+    if (gen_flags & GEN_FLAG_CAPTURES)
+      moves = generate_en_passant_moves(board, moves, king_sq);
+    moves = generate_piece_moves(board, moves, gen_flags, PIECE_TYPE_KNIGHT, &masks);
+    moves = generate_piece_moves(board, moves, gen_flags, PIECE_TYPE_BISHOP, &masks);
+    moves = generate_piece_moves(board, moves, gen_flags, PIECE_TYPE_ROOK, &masks);
+    moves = generate_piece_moves(board, moves, gen_flags, PIECE_TYPE_QUEEN, &masks);
   }
+  moves = generate_king_moves(board, moves, gen_flags, king_sq, check_count > 0);
   return moves - base;
 }
+
+/*
+ * Cheaply verify that a move taken from outside the current move list (such
+ * as a transposition table hash move) is legal in the current position.
+ */
+int
+board_is_legal_move(struct board *board, Move move)
+{
+  struct position *pos;
+  Bitboard all, targets;
+  int col, forward, origin, dest, piece_type, legal;
+  pos = board_position(board);
+  col = board_turn(board);
+  forward = col ? 8 : -8;
+  origin = move_origin(move);
+  dest = move_dest(move);
+  all = pos->color_bitboards[0] | pos->color_bitboards[1];
+  if ((pos->color_bitboards[col] & set_bit(origin)) == 0
+  ||  (pos->color_bitboards[col] & set_bit(dest)))
+    return 0;
+  if (move_special_type(move) != SPECIAL_MOVE_PROMOTE && move_promote_piece(move))
+    return 0;
+  piece_type = get_piece_type(pos->mailbox, origin);
+
+  switch (move_special_type(move)) {
+  case SPECIAL_MOVE_CASTLING:
+    if (piece_type != PIECE_TYPE_KING)
+      return 0;
+    if (move == castle_move(col, 1)) {
+      if ( (pos->flags & KING_CASTLE_BOARD_FLAG(col))
+      ||   (all & KING_CASTLE_GAP(col))
+      ||   (board_attack_set(board, !col) & KING_CASTLE_CHECK_SQUARES(col)))
+        return 0;
+    } else if (move == castle_move(col, 0)) {
+      if ( (pos->flags & QUEEN_CASTLE_BOARD_FLAG(col))
+      ||   (all & QUEEN_CASTLE_GAP(col))
+      ||   (board_attack_set(board, !col) & QUEEN_CASTLE_CHECK_SQUARES(col)))
+        return 0;
+    } else {
+      return 0;
+    }
+    /* castling never exposes the king */
+    return 1;
+  case SPECIAL_MOVE_EN_PASSANT:
+    if (piece_type != PIECE_TYPE_PAWN || dest != pos->en_passant_square
+    ||  (dest - forward - origin != 1 && dest - forward - origin != -1)
+    ||  (origin / 8) != (dest - forward) / 8)
+      return 0;
+    break;
+  case SPECIAL_MOVE_PROMOTE:
+  case SPECIAL_MOVE_NONE:
+    if (piece_type == PIECE_TYPE_PAWN) {
+      if ((dest / 8 == 0 || dest / 8 == 7) != (move_special_type(move) == SPECIAL_MOVE_PROMOTE))
+        return 0;
+      if (dest == origin + forward)
+        targets = set_bit(dest) & ~all;
+      else if (dest == origin + 2 * forward && origin / 8 == (col ? 1 : 6))
+        targets = (all & (set_bit(origin + forward) | set_bit(dest))) ? 0 : set_bit(dest);
+      else if ((dest == origin + forward + 1 && origin % 8 != 7)
+           ||  (dest == origin + forward - 1 && origin % 8 != 0))
+        targets = set_bit(dest) & pos->color_bitboards[!col];
+      else
+        targets = 0;
+    } else if (move_special_type(move) == SPECIAL_MOVE_PROMOTE) {
+      return 0;
+    } else {
+      switch (piece_type) {
+      case PIECE_TYPE_KNIGHT:
+        targets = knight_attack_table[origin];
+        break;
+      case PIECE_TYPE_BISHOP:
+        targets = get_bishop_attack_set(origin, all);
+        break;
+      case PIECE_TYPE_ROOK:
+        targets = get_rook_attack_set(origin, all);
+        break;
+      case PIECE_TYPE_QUEEN:
+        targets = get_rook_attack_set(origin, all) | get_bishop_attack_set(origin, all);
+        break;
+      case PIECE_TYPE_KING:
+        targets = king_attack_table[origin];
+        break;
+      default:
+        return 0;
+      }
+    }
+    if ((targets & set_bit(dest)) == 0)
+      return 0;
+    break;
+  }
+
+  /* the move is pseudo legal, make sure it does not expose the king */
+  board_push(board, move);
+  pos = board_position(board);
+  legal = (find_attackers(pos,
+        lss(pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[col]),
+        pos->color_bitboards[0] | pos->color_bitboards[1])
+      & pos->color_bitboards[!col]) == 0;
+  board_pop(board, move);
+  return legal;
+}
+
+/*
+ * Whether a legal move checks the opponent, found without making it:
+ * the moved piece attacks the king from its destination, or a slider of
+ * ours sees the king through the squares the move vacates.
+ */
+int
+board_gives_check(struct board *board, Move move)
+{
+  struct position *pos;
+  Bitboard occupied, diagonal, straight, moved;
+  int col, origin, dest, piece_type, king_sq, rook_origin, rook_dest;
+  pos = board_position(board);
+  col = board_turn(board);
+  origin = move_origin(move);
+  dest = move_dest(move);
+  king_sq = lss(pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[!col]);
+  piece_type = get_piece_type(pos->mailbox, origin);
+  occupied = ((pos->color_bitboards[0] | pos->color_bitboards[1]) & ~set_bit(origin))
+    | set_bit(dest);
+  moved = set_bit(origin);
+  switch (move_special_type(move)) {
+  case SPECIAL_MOVE_PROMOTE:
+    piece_type = move_promote_piece(move);
+    break;
+  case SPECIAL_MOVE_EN_PASSANT:
+    occupied &= ~set_bit(dest + (col ? -8 : 8));
+    break;
+  case SPECIAL_MOVE_CASTLING:
+    /* the king can not give check itself, but the rook can */
+    if (!castle_rook_squares(dest, &rook_origin, &rook_dest))
+      break;
+    occupied = (occupied & ~set_bit(rook_origin)) | set_bit(rook_dest);
+    moved |= set_bit(rook_origin);
+    piece_type = PIECE_TYPE_ROOK;
+    dest = rook_dest;
+    break;
+  }
+
+  diagonal = (pos->type_bitboards[PIECE_TYPE_BISHOP] | pos->type_bitboards[PIECE_TYPE_QUEEN])
+    & pos->color_bitboards[col] & ~moved;
+  straight = (pos->type_bitboards[PIECE_TYPE_ROOK] | pos->type_bitboards[PIECE_TYPE_QUEEN])
+    & pos->color_bitboards[col] & ~moved;
+  if (piece_type == PIECE_TYPE_BISHOP || piece_type == PIECE_TYPE_QUEEN)
+    diagonal |= set_bit(dest);
+  if (piece_type == PIECE_TYPE_ROOK || piece_type == PIECE_TYPE_QUEEN)
+    straight |= set_bit(dest);
+  if (piece_type == PIECE_TYPE_PAWN && (pawn_attacks(set_bit(dest), col) & set_bit(king_sq)))
+    return 1;
+  if (piece_type == PIECE_TYPE_KNIGHT && (knight_attack_table[dest] & set_bit(king_sq)))
+    return 1;
+  return ((get_bishop_attack_set(king_sq, occupied) & diagonal)
+      | (get_rook_attack_set(king_sq, occupied) & straight)) != 0;
+}
@@ -14,6 +14,7 @@
 /* non-promote pieces */
 #define PIECE_TYPE_PAWN   4
 #define PIECE_TYPE_KING   5
+#define PIECE_TYPE_NONE   6
 
 #define COLOR_BLACK 0
 #define COLOR_WHITE 1
@@ -38,12 +39,33 @@
 #define KING_CASTLE_CHECK_SQUARES(color) (color ? (set_bit(4) | set_bit(5) | set_bit(6)) : (set_bit(60) | set_bit(61) | set_bit(62)))
 #define QUEEN_CASTLE_CHECK_SQUARES(color) (color ? (set_bit(2) | set_bit(3) | set_bit(4)) : (set_bit(58) | set_bit(59) | set_bit(60)))
 
+#define LIGHT_SQUARES 0x55aa55aa55aa55aaULL
+
 #define MAX_FEN_SIZE (8 * 8 + 7 + 1 + 4 + 2 + 6 + 6 + 5)
 
 #define MAX_SEARCH_PLY 128
+#define REPETITION_FILTER_SIZE 256
 #define CHECKMATE_EVALUATION 655535
+#define PHASE_MAX 24
 
+/*
+ * Captures include promotions and en passant. Quiet generation always
+ * includes every king move, so ~GEN_FLAG_CAPTURES matches the quiet perft
+ * of scripts/test.py.
+ */
 #define GEN_FLAG_CAPTURES 1
+#define GEN_FLAG_QUIETS   2
+
+#define ATTACK_SET_VALID(color)        (0x01 << (color))
+#define SLIDER_ATTACK_SET_VALID(color) (0x04 << (color))
+
+/* 2^18 buckets of 64 bytes, 16MiB */
+#define TT_BUCKET_BITS 18
+#define TT_BUCKET_SIZE 4
+
+#define TT_BOUND_EXACT 0
+#define TT_BOUND_LOWER 1
+#define TT_BOUND_UPPER 2
 
 typedef uint64_t Bitboard;
 typedef uint16_t BoardFlags;
@@ -56,25 +78,123 @@ typedef uint16_t BoardFlags;
  */
 typedef uint16_t Move;
 
+/* instructions detected by init_bitboards() */
+#define CPU_POPCNT 0x01
+#define CPU_PEXT   0x02
+#define CPU_AVX2   0x04
+
 struct magic_square {
   uint64_t magic; 
   int bits;
-  int attack_table_offset;
 };
 
+/*
+ * Everything a slider lookup needs for one square, in one cache line.
+ * Entries for pext leave magic and shift unused.
+ */
+struct magic_entry {
+  uint64_t mask;
+  uint64_t magic;
+  const uint64_t *attacks;
+  int shift;
+} __attribute__((aligned(32)));
+
+/*
+ * key is the full position hash XORed with data, data is packed as:
+ * 0-15  best move
+ * 16-47 score
+ * 48-55 depth
+ * 56-57 bound
+ * 58-63 age
+ */
+struct tt_entry {
+  uint64_t key;
+  uint64_t data;
+};
+
+/*
+ * Moves are made and unmade in place on a single position. Each ply pushes
+ * an undo record holding whatever board_pop() can not recompute.
+ */
 struct board {
   int ply;
   int fullmove_clock;
   struct position {
     Bitboard type_bitboards[6];
     Bitboard color_bitboards[2];
-    uint8_t mailbox[32]; /* 4-bits per piece */
+    uint8_t mailbox[64]; /* piece type per square */
     BoardFlags flags;
     int16_t en_passant_square;
     uint16_t halfmove_clock;
     uint64_t pawn_hash, non_pawn_hash;
+    /* material and piece-square sums, white minus black, see evaluate.c */
+    int16_t mg_score, eg_score;
+    uint8_t phase;
+    /* attack sets are computed lazily, see board_attack_set() */
     uint64_t attack_sets[2];
-  } stack[MAX_SEARCH_PLY];
+    uint64_t slider_attack_sets[2];
+    uint8_t attack_sets_valid;
+  } position __attribute__((aligned(64)));
+  struct undo {
+    uint64_t pawn_hash, non_pawn_hash;
+    BoardFlags flags;
+    int16_t en_passant_square;
+    uint16_t halfmove_clock;
+    int16_t mg_score, eg_score;
+    uint8_t phase;
+    uint8_t captured_piece;
+    uint8_t attack_sets_valid;
+    uint64_t attack_sets[2];
+    uint64_t slider_attack_sets[2];
+  } undo_stack[MAX_SEARCH_PLY];
+  /* counts of the earlier positions on the stack by low hash bits */
+  uint8_t repetition_filter[REPETITION_FILTER_SIZE];
+  /* accumulator per ply when evaluating with a network, otherwise NULL */
+  struct nnue_accumulator *nnue;
+};
+
+#define NNUE_INPUTS (64 * 2 * 6 * 64)
+#define NNUE_L1 256
+#define NNUE_L2 32
+#define NNUE_L3 32
+
+/* first layer sums for both sides and the pieces changed by the last move */
+struct nnue_accumulator {
+  int16_t values[2][NNUE_L1];
+  uint8_t computed[2];
+  /* set when that side's king moved, so it can not be updated */
+  uint8_t refresh[2];
+  uint8_t dirty_count;
+  struct nnue_dirty_piece {
+    uint8_t color, piece_type, square;
+    int8_t delta;
+  } dirty[6];
+} __attribute__((aligned(64)));
+
+/* per thread move ordering state */
+struct move_order {
+  Move killers[MAX_SEARCH_PLY][2];
+  int history[2][64][64];
+  long cutoffs, first_move_cutoffs;
+};
+
+/* per node state of next_move(), which generates moves in stages */
+struct move_picker {
+  Move moves[256];
+  int scores[256];
+  int count, index, stage;
+  Move hash_move;
+  Move killers[2];
+};
+
+/*
+ * Positions for evaluate_batch(), one array of count bitboards per piece
+ * type and color. No board or search state is needed.
+ */
+struct position_batch {
+  int count;
+  const Bitboard *type_bitboards[6];
+  const Bitboard *color_bitboards[2];
 };
 
 /* zobrist_numbers.c */
@@ -84,8 +204,29 @@ extern uint64_t zobrist_en_passant_numbers[8];
 extern uint64_t zobrist_black_number;
 
 /* magic_numbers.c */
-extern struct magic_square magic_squares[];
-extern uint64_t attack_table[142244];
+extern const struct magic_square magic_squares[];
+
+/* slider_attacks.c, only linked into the build tools */
+extern uint64_t rook_relevance_masks[64];
+extern uint64_t bishop_relevance_masks[64];
+void init_relevance_masks(void);
+uint64_t primitive_bishop_attack_squares(int square, uint64_t blockers);
+uint64_t primitive_rook_attack_squares(int square, uint64_t blockers);
+uint64_t generate_mock_blockers(uint64_t mask, int index);
+int init_magic_square(int square, int rook, uint64_t magic, int bits,
+    uint64_t *attack_table);
+uint64_t *pack_magic_tables(const struct magic_square *magics, int *offsets,
+    int *size);
+
+/* attack_tables.c, written by generate_attack_tables during the build */
+#ifndef GENERATING_ATTACK_TABLES
+extern const uint64_t knight_attack_table[64];
+extern const uint64_t king_attack_table[64];
+extern const struct magic_entry rook_magics[64];
+extern const struct magic_entry bishop_magics[64];
+extern const struct magic_entry rook_pexts[64];
+extern const struct magic_entry bishop_pexts[64];
+#endif
 
 /* utils.c */
 extern const char *square_names[64];
@@ -98,25 +239,73 @@ void print_board(struct board *board);
 void read_buffer(char *buffer, int len);
 
 /* bitboards.c */
-extern uint64_t knight_attack_table[64];
-extern uint64_t king_attack_table[64];
-void print_best_magics(void);
+extern int cpu_features;
 void init_bitboards(void);
-uint64_t get_rook_attack_set(int rook_square, uint64_t blockers);
-uint64_t get_bishop_attack_set(int bishop_square, uint64_t blockers);
 
 /* board.c */
+void update_attack_set(struct position *pos, int col);
+Bitboard find_attackers(struct position *pos, int square, Bitboard occupied);
 int create_board(struct board *board, const char *fen);
 void board_push(struct board *board, Move move);
 void board_pop(struct board *board, Move move);
+void board_push_null(struct board *board);
+void board_pop_null(struct board *board);
 int board_is_repetition(struct board *board);
+int board_is_draw(struct board *board);
 int board_moves(struct board *board, Move *moves, int gen_flags);
+int board_is_legal_move(struct board *board, Move move);
+int board_gives_check(struct board *board, Move move);
+
+/* transposition.c */
+void tt_clear(void);
+void tt_new_search(void);
+int tt_probe(uint64_t hash, int ply, Move *move, int *depth, int *bound, int *score);
+void tt_store(uint64_t hash, int ply, Move move, int depth, int bound, int score);
 
 /* evaluate.c */
+extern const int piece_values[6];
+extern const int phase_weights[6];
+extern const int16_t psq_mg_tables[6][64];
+extern const int16_t psq_eg_tables[6][64];
+void init_position_evaluation(struct position *pos);
 int evaluate_board(struct board *board);
+void eval_cache_counters(long *hits, long *misses);
+void free_eval_cache(void);
+void evaluate_batch(const struct position_batch *batch, int *scores);
+
+/* perft.c */
+long perft(struct board *board, int depth, int gen_flags, int thread_count);
+
+/* nnue.c */
+int nnue_load(const char *path);
+void nnue_unload(void);
+int nnue_enabled(void);
+void nnue_reset(struct board *board, struct nnue_accumulator *stack);
+int nnue_evaluate(struct board *board);
+
+/* pawns.c */
+void evaluate_pawn_structure(struct position *pos, int *mg, int *eg);
+void pawn_table_counters(long *hits, long *misses);
+void free_pawn_table(void);
+void find_pawn_structure(const Bitboard *type_bitboards, const Bitboard *color_bitboards,
+    int *mg, int *eg);
+
+/* move_order.c */
+int move_is_quiet(struct board *board, Move move);
+void clear_move_order(struct move_order *order);
+void score_moves(struct move_order *order, struct board *board, Move *moves,
+    int *scores, int count);
+Move pick_move(Move *moves, int *scores, int index, int count);
+void record_cutoff(struct move_order *order, struct board *board, Move move,
+    int depth, int move_index);
+void init_move_picker(struct move_picker *picker, struct move_order *order,
+    struct board *board, Move hash_move);
+Move next_move(struct move_picker *picker, struct move_order *order,
+    struct board *board);
 
 /* find_move.c */
-Move find_move(struct board *board, int milliseconds, int verbose);
+void init_search(void);
+Move find_move(struct board *board, int milliseconds, int thread_count, int verbose);
 
 /* Bitboard inline functions */
 
@@ -124,6 +313,16 @@ static inline int
 count_bits(Bitboard b)
 {
   int count;
+#if defined(__POPCNT__)
+  return __builtin_popcountll(b);
+#elif defined(__x86_64__)
+  /* the build targets no particular isa, so check for popcnt at runtime */
+  uint64_t result;
+  if (__builtin_expect(cpu_features & CPU_POPCNT, 1)) {
+    __asm__ ("popcntq %1, %0" : "=r" (result) : "rm" (b));
+    return result;
+  }
+#endif
   for (count = 0; b; count++, b &= b - 1);
   return count;
 }
@@ -168,27 +367,61 @@ set_bit(int square)
   return (uint64_t)1 << square;
 }
 
+/* Slider inline functions */
+
+#ifndef GENERATING_ATTACK_TABLES
+/*
+ * With BMI2, pext packs the relevant blockers straight into an index, so
+ * each square needs exactly 2^bits entries and no multiplication. The
+ * magic entries stay as the fallback for other cpus.
+ */
+static inline uint64_t
+pext(uint64_t src, uint64_t mask)
+{
+#if defined(__x86_64__)
+  uint64_t result;
+  __asm__ ("pextq %2, %1, %0" : "=r" (result) : "r" (src), "rm" (mask));
+  return result;
+#else
+  assert(0);
+  return 0;
+#endif
+}
+static inline Bitboard
+slider_attack_set(const struct magic_entry *magics, const struct magic_entry *pexts,
+    int square, Bitboard blockers)
+{
+  const struct magic_entry *entry;
+  if (cpu_features & CPU_PEXT) {
+    entry = &pexts[square];
+    return entry->attacks[pext(blockers, entry->mask)];
+  }
+  entry = &magics[square];
+  return entry->attacks[((blockers & entry->mask) * entry->magic) >> entry->shift];
+}
+static inline Bitboard
+get_rook_attack_set(int rook_square, Bitboard blockers)
+{
+  return slider_attack_set(rook_magics, rook_pexts, rook_square, blockers);
+}
+static inline Bitboard
+get_bishop_attack_set(int bishop_square, Bitboard blockers)
+{
+  return slider_attack_set(bishop_magics, bishop_pexts, bishop_square, blockers);
+}
+#endif
+
 /* Mailbox inline functions */
 
 static inline int
 get_piece_type(const uint8_t *mailbox, int square)
 {
-  if (square % 2 == 0)
-    return mailbox[square / 2] & 0x0f;
-  else
-    return mailbox[square / 2] >> 4;
+  return mailbox[square];
 }
 static inline void
 set_piece_type(uint8_t *mailbox, int square, int piece_type)
 {
-  assert((piece_type & 0x0f) == piece_type);
-  if (square % 2 == 0) {
-    mailbox[square / 2] &= 0xf0;
-    mailbox[square / 2] |= piece_type;
-  } else {
-    mailbox[square / 2] &= 0x0f;
-    mailbox[square / 2] |= piece_type << 4;
-  }
+  mailbox[square] = piece_type;
 }
 
 /* Move inline functions */
@@ -250,13 +483,27 @@ move_promote_piece(Move move)
 static inline struct position *
 board_position(struct board *board)
 {
-  return &board->stack[board->ply];
+  return &board->position;
 }
 static inline int
 board_turn(struct board *board)
 {
   return (board_position(board)->flags & BOARD_FLAG_WHITE_TO_PLAY) ? COLOR_WHITE : COLOR_BLACK;
 }
+static inline uint64_t
+board_hash(struct board *board)
+{
+  return board_position(board)->pawn_hash ^ board_position(board)->non_pawn_hash;
+}
+static inline Bitboard
+board_attack_set(struct board *board, int col)
+{
+  struct position *pos;
+  pos = board_position(board);
+  if ((pos->attack_sets_valid & ATTACK_SET_VALID(col)) == 0)
+    update_attack_set(pos, col);
+  return pos->attack_sets[col];
+}
 static inline int
 board_in_check(struct board *board)
 {
@@ -265,9 +512,10 @@ board_in_check(struct board *board)
   pos = board_position(board);
   col = board_turn(board);
   return (
-      pos->type_bitboards[PIECE_TYPE_KING]
-    & pos->color_bitboards[col]
-    & pos->attack_sets[!col]
+      find_attackers(pos,
+        lss(pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[col]),
+        pos->color_bitboards[0] | pos->color_bitboards[1])
+    & pos->color_bitboards[!col]
   ) ? 1 : 0;
 }
 
@@ -279,6 +527,13 @@ get_zobrist_piece_number(int color, int piece_type, int square)
   return zobrist_piece_numbers[color * 6 * 64 + piece_type * 64 + square];
 }
 
+/* piece-square tables are stored from white's side with a8 first */
+static inline int
+psq_index(int color, int square)
+{
+  return color == COLOR_WHITE ? square ^ 56 : square;
+}
+
 static inline uint64_t
 random_uint64(void)
 {
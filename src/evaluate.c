@@ -2,37 +2,284 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "chess.h"
 
+/*
+ * Scores are in centipawns from white's point of view. Each piece is worth
+ * its material value plus a piece-square bonus, with separate tables for
+ * the middlegame and the endgame. board_push() keeps the sums up to date
+ * in the position, so a leaf only adds the cached pawn structure terms and
+ * blends the two by the game phase.
+ */
+
+const int piece_values[6] = {
+  [PIECE_TYPE_PAWN]   = 100,
+  [PIECE_TYPE_KNIGHT] = 320,
+  [PIECE_TYPE_BISHOP] = 330,
+  [PIECE_TYPE_ROOK]   = 500,
+  [PIECE_TYPE_QUEEN]  = 900,
+  [PIECE_TYPE_KING]   = 0,
+};
+
+/* the phase is PHASE_MAX with all pieces on the board and 0 with none */
+const int phase_weights[6] = {
+  [PIECE_TYPE_PAWN]   = 0,
+  [PIECE_TYPE_KNIGHT] = 1,
+  [PIECE_TYPE_BISHOP] = 1,
+  [PIECE_TYPE_ROOK]   = 2,
+  [PIECE_TYPE_QUEEN]  = 4,
+  [PIECE_TYPE_KING]   = 0,
+};
+
+/*
+ * Leaf scores are cached per thread, keyed on the full position hash, so
+ * transpositions and re-searches do not evaluate the same leaf again.
+ * An entry is a single word, the top bits of the key to verify a hit over
+ * the score, so it is never seen half written.
+ */
+#define EVAL_CACHE_BITS 16
+#define EVAL_CACHE_SIZE (1 << EVAL_CACHE_BITS)
+
+struct eval_cache {
+  uint64_t entries[EVAL_CACHE_SIZE];
+  long hits, misses;
+};
+
+static __thread struct eval_cache *eval_cache;
+
+/* tables are laid out as seen by white, a8 first, and flipped for black */
+#define PAWN_MG_TABLE { \
+    0,   0,   0,   0,   0,   0,   0,   0, \
+   50,  50,  50,  50,  50,  50,  50,  50, \
+   10,  10,  20,  30,  30,  20,  10,  10, \
+    5,   5,  10,  25,  25,  10,   5,   5, \
+    0,   0,   0,  20,  20,   0,   0,   0, \
+    5,  -5, -10,   0,   0, -10,  -5,   5, \
+    5,  10,  10, -20, -20,  10,  10,   5, \
+    0,   0,   0,   0,   0,   0,   0,   0, \
+}
+#define PAWN_EG_TABLE { \
+    0,   0,   0,   0,   0,   0,   0,   0, \
+   80,  80,  80,  80,  80,  80,  80,  80, \
+   50,  50,  50,  50,  50,  50,  50,  50, \
+   30,  30,  30,  30,  30,  30,  30,  30, \
+   15,  15,  15,  15,  15,  15,  15,  15, \
+    5,   5,   5,   5,   5,   5,   5,   5, \
+    0,   0,   0,   0,   0,   0,   0,   0, \
+    0,   0,   0,   0,   0,   0,   0,   0, \
+}
+#define KNIGHT_TABLE { \
+  -50, -40, -30, -30, -30, -30, -40, -50, \
+  -40, -20,   0,   0,   0,   0, -20, -40, \
+  -30,   0,  10,  15,  15,  10,   0, -30, \
+  -30,   5,  15,  20,  20,  15,   5, -30, \
+  -30,   0,  15,  20,  20,  15,   0, -30, \
+  -30,   5,  10,  15,  15,  10,   5, -30, \
+  -40, -20,   0,   5,   5,   0, -20, -40, \
+  -50, -40, -30, -30, -30, -30, -40, -50, \
+}
+#define BISHOP_TABLE { \
+  -20, -10, -10, -10, -10, -10, -10, -20, \
+  -10,   0,   0,   0,   0,   0,   0, -10, \
+  -10,   0,   5,  10,  10,   5,   0, -10, \
+  -10,   5,   5,  10,  10,   5,   5, -10, \
+  -10,   0,  10,  10,  10,  10,   0, -10, \
+  -10,  10,  10,  10,  10,  10,  10, -10, \
+  -10,   5,   0,   0,   0,   0,   5, -10, \
+  -20, -10, -10, -10, -10, -10, -10, -20, \
+}
+#define ROOK_TABLE { \
+    0,   0,   0,   0,   0,   0,   0,   0, \
+    5,  10,  10,  10,  10,  10,  10,   5, \
+   -5,   0,   0,   0,   0,   0,   0,  -5, \
+   -5,   0,   0,   0,   0,   0,   0,  -5, \
+   -5,   0,   0,   0,   0,   0,   0,  -5, \
+   -5,   0,   0,   0,   0,   0,   0,  -5, \
+   -5,   0,   0,   0,   0,   0,   0,  -5, \
+    0,   0,   0,   5,   5,   0,   0,   0, \
+}
+#define QUEEN_TABLE { \
+  -20, -10, -10,  -5,  -5, -10, -10, -20, \
+  -10,   0,   0,   0,   0,   0,   0, -10, \
+  -10,   0,   5,   5,   5,   5,   0, -10, \
+   -5,   0,   5,   5,   5,   5,   0,  -5, \
+    0,   0,   5,   5,   5,   5,   0,  -5, \
+  -10,   5,   5,   5,   5,   5,   0, -10, \
+  -10,   0,   5,   0,   0,   0,   0, -10, \
+  -20, -10, -10,  -5,  -5, -10, -10, -20, \
+}
+#define KING_MG_TABLE { \
+  -30, -40, -40, -50, -50, -40, -40, -30, \
+  -30, -40, -40, -50, -50, -40, -40, -30, \
+  -30, -40, -40, -50, -50, -40, -40, -30, \
+  -30, -40, -40, -50, -50, -40, -40, -30, \
+  -20, -30, -30, -40, -40, -30, -30, -20, \
+  -10, -20, -20, -20, -20, -20, -20, -10, \
+   20,  20,   0,   0,   0,   0,  20,  20, \
+   20,  30,  10,   0,   0,  10,  30,  20, \
+}
+#define KING_EG_TABLE { \
+  -50, -40, -30, -20, -20, -30, -40, -50, \
+  -30, -20, -10,   0,   0, -10, -20, -30, \
+  -30, -10,  20,  30,  30,  20, -10, -30, \
+  -30, -10,  30,  40,  40,  30, -10, -30, \
+  -30, -10,  30,  40,  40,  30, -10, -30, \
+  -30, -10,  20,  30,  30,  20, -10, -30, \
+  -30, -30,   0,   0,   0,   0, -30, -30, \
+  -50, -30, -30, -30, -30, -30, -30, -50, \
+}
+
+const int16_t psq_mg_tables[6][64] = {
+  [PIECE_TYPE_PAWN]   = PAWN_MG_TABLE,
+  [PIECE_TYPE_KNIGHT] = KNIGHT_TABLE,
+  [PIECE_TYPE_BISHOP] = BISHOP_TABLE,
+  [PIECE_TYPE_ROOK]   = ROOK_TABLE,
+  [PIECE_TYPE_QUEEN]  = QUEEN_TABLE,
+  [PIECE_TYPE_KING]   = KING_MG_TABLE,
+};
+
+const int16_t psq_eg_tables[6][64] = {
+  [PIECE_TYPE_PAWN]   = PAWN_EG_TABLE,
+  [PIECE_TYPE_KNIGHT] = KNIGHT_TABLE,
+  [PIECE_TYPE_BISHOP] = BISHOP_TABLE,
+  [PIECE_TYPE_ROOK]   = ROOK_TABLE,
+  [PIECE_TYPE_QUEEN]  = QUEEN_TABLE,
+  [PIECE_TYPE_KING]   = KING_EG_TABLE,
+};
+
+/* computes the incrementally updated terms from scratch */
+static void
+find_position_evaluation(const Bitboard *type_bitboards, const Bitboard *color_bitboards,
+    int *mg, int *eg, int *phase)
+{
+  Bitboard pieces;
+  int col, piece_type, square, index, sign;
+  *mg = *eg = *phase = 0;
+  for (col = 0; col < 2; col++) {
+    sign = col == COLOR_WHITE ? 1 : -1;
+    for (piece_type = 0; piece_type <= PIECE_TYPE_KING; piece_type++) {
+      pieces = type_bitboards[piece_type] & color_bitboards[col];
+      while (pieces) {
+        square = pop_lss(&pieces);
+        index = psq_index(col, square);
+        *mg += sign * (piece_values[piece_type] + psq_mg_tables[piece_type][index]);
+        *eg += sign * (piece_values[piece_type] + psq_eg_tables[piece_type][index]);
+        *phase += phase_weights[piece_type];
+      }
+    }
+  }
+}
+
+void
+init_position_evaluation(struct position *pos)
+{
+  int mg, eg, phase;
+  find_position_evaluation(pos->type_bitboards, pos->color_bitboards, &mg, &eg, &phase);
+  pos->mg_score = mg;
+  pos->eg_score = eg;
+  pos->phase = phase;
+}
+
+/* blends the middlegame and endgame scores by the game phase */
+static inline int
+taper(int mg, int eg, int phase)
+{
+  /* promotions can take the phase past its starting value */
+  phase = phase < PHASE_MAX ? phase : PHASE_MAX;
+  return (mg * phase + eg * (PHASE_MAX - phase)) / PHASE_MAX;
+}
+
 static int
-material_count(struct board *board)
+evaluate_position(struct board *board)
 {
   struct position *pos;
-  Bitboard bitboard;
-  int material;
+  int mg, eg;
+#ifdef CHECK_EVALUATION
+  int phase;
+#endif
+  if (board->nnue)
+    return nnue_evaluate(board);
   pos = board_position(board);
-
-  material = 0;
-  bitboard = pos->type_bitboards[PIECE_TYPE_PAWN];
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_WHITE]) * 1;
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_BLACK]) * -1;
-  bitboard
-    = pos->type_bitboards[PIECE_TYPE_BISHOP]
-    | pos->type_bitboards[PIECE_TYPE_KNIGHT];
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_WHITE]) * 3;
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_BLACK]) * -3;
-  bitboard = pos->type_bitboards[PIECE_TYPE_ROOK];
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_WHITE]) * 5;
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_BLACK]) * -5;
-  bitboard = pos->type_bitboards[PIECE_TYPE_QUEEN];
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_WHITE]) * 9;
-  material += count_bits(bitboard & pos->color_bitboards[COLOR_BLACK]) * -9;
-  return material;
+#ifdef CHECK_EVALUATION
+  find_position_evaluation(pos->type_bitboards, pos->color_bitboards, &mg, &eg, &phase);
+  assert(mg == pos->mg_score && eg == pos->eg_score && phase == pos->phase);
+#endif
+  evaluate_pawn_structure(pos, &mg, &eg);
+  mg += pos->mg_score;
+  eg += pos->eg_score;
+  return taper(mg, eg, pos->phase);
 }
 
 int
 evaluate_board(struct board *board)
 {
-  return material_count(board);
+  struct position *pos;
+  uint64_t key, check, *entry;
+  int score;
+  if (eval_cache == NULL) {
+    if ( (eval_cache = calloc(1, sizeof(struct eval_cache))) == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+  }
+  pos = board_position(board);
+  key = pos->pawn_hash ^ pos->non_pawn_hash;
+  /* never zero, so an empty entry can not match */
+  check = (key >> 32) | 1;
+  entry = &eval_cache->entries[key & (EVAL_CACHE_SIZE - 1)];
+  if (*entry >> 32 == check) {
+    eval_cache->hits++;
+#ifdef CHECK_EVALUATION
+    assert((int32_t)*entry == evaluate_position(board));
+#endif
+    return (int32_t)*entry;
+  }
+  eval_cache->misses++;
+  score = evaluate_position(board);
+  *entry = check << 32 | (uint32_t)score;
+  return score;
+}
+
+/* returns and clears the calling thread's counters */
+void
+eval_cache_counters(long *hits, long *misses)
+{
+  *hits = *misses = 0;
+  if (eval_cache == NULL)
+    return;
+  *hits = eval_cache->hits;
+  *misses = eval_cache->misses;
+  eval_cache->hits = eval_cache->misses = 0;
+}
+
+/* threads that exit must release their cache, and a new evaluator needs
+ * an empty one */
+void
+free_eval_cache(void)
+{
+  free(eval_cache);
+  eval_cache = NULL;
+}
+
+/*
+ * Classical evaluation of many positions in one call, for labelling data
+ * outside the search. scores[i] is what evaluate_board() would return for
+ * position i without a network loaded. The pawn table is not used.
+ */
+void
+evaluate_batch(const struct position_batch *batch, int *scores)
+{
+  Bitboard type_bitboards[6], color_bitboards[2];
+  int mg, eg, phase, pawn_mg, pawn_eg, i, j;
+  for (i = 0; i < batch->count; i++) {
+    for (j = 0; j < 6; j++)
+      type_bitboards[j] = batch->type_bitboards[j][i];
+    for (j = 0; j < 2; j++)
+      color_bitboards[j] = batch->color_bitboards[j][i];
+    find_position_evaluation(type_bitboards, color_bitboards, &mg, &eg, &phase);
+    find_pawn_structure(type_bitboards, color_bitboards, &pawn_mg, &pawn_eg);
+    scores[i] = taper(mg + pawn_mg, eg + pawn_eg, phase);
+  }
 }
@@ -0,0 +1,192 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "chess.h"
+
+/*
+ * Searches for magic numbers that keep the attack table small and prints
+ * them as a drop-in magic_numbers.c. The squares are shared out between
+ * threads. Each square draws its random numbers from a generator seeded
+ * by the seed and the square, so a seed gives the same magics whatever
+ * the thread count.
+ *
+ * What counts is the packed table, not the bits of a square: a square's
+ * sub-table costs the span between its first and last used slot, since
+ * the empty slots around it are free for other squares to overlap.
+ *
+ * usage: find_magics [seed [attempts [threads]]] > src/magic_numbers.c
+ */
+
+#define DEFAULT_ATTEMPTS 100000
+#define SPARE_BITS 2
+
+struct magic_search {
+  uint64_t seed;
+  int attempts;
+  int next_square;
+  struct magic_square results[128];
+  int spans[128];
+};
+
+/* splitmix64, cheap and good enough to draw candidate magics from */
+static uint64_t
+next_random(uint64_t *state)
+{
+  uint64_t z;
+  z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/*
+ * Returns the span of used slots if magic hashes every blocker set
+ * without a destructive collision, 0 otherwise. stamps marks the slots
+ * filled by this attempt so the table never needs clearing.
+ */
+static int
+try_magic(const uint64_t *blockers, const uint64_t *attacks, int count,
+    uint64_t magic, int bits, uint64_t *table, int *stamps, int stamp)
+{
+  uint64_t hash;
+  int i, first, last;
+  first = 1 << bits;
+  last = 0;
+  for (i = 0; i < count; i++) {
+    hash = (blockers[i] * magic) >> (64 - bits);
+    if (stamps[hash] != stamp) {
+      stamps[hash] = stamp;
+      table[hash] = attacks[i];
+      if (hash < first)
+        first = hash;
+      if (hash > last)
+        last = hash;
+    } else if (table[hash] != attacks[i]) {
+      return 0;
+    }
+  }
+  return last - first + 1;
+}
+
+/* smallest span first, then the fewest bits */
+static void
+find_magic(struct magic_search *search, int i)
+{
+  uint64_t blockers[4096], attacks[4096], *table;
+  uint64_t state, mask, magic;
+  int *stamps, square, count, max_bits, bits, attempt, span, stamp, found, j;
+  square = i % 64;
+  mask = i > 63 ? rook_relevance_masks[square] : bishop_relevance_masks[square];
+  count = 1 << count_bits(mask);
+  for (j = 0; j < count; j++) {
+    blockers[j] = generate_mock_blockers(mask, j);
+    attacks[j] = i > 63
+      ? primitive_rook_attack_squares(square, blockers[j])
+      : primitive_bishop_attack_squares(square, blockers[j]);
+  }
+  state = search->seed ^ (uint64_t)i * 0xd1342543de82ef95ULL;
+  /* spare bits make a magic easy to find and can still pack small */
+  max_bits = count_bits(mask) + SPARE_BITS;
+  table = xmalloc(((size_t)1 << max_bits) * sizeof(uint64_t));
+  stamps = xmalloc(((size_t)1 << max_bits) * sizeof(int));
+  for (j = 0; j < 1 << max_bits; j++)
+    stamps[j] = -1;
+  search->spans[i] = 0;
+  stamp = 0;
+  for (bits = max_bits; bits > 0; bits--) {
+    found = 0;
+    for (attempt = 0; attempt < search->attempts; attempt++) {
+      magic = next_random(&state) & next_random(&state) & next_random(&state);
+      span = try_magic(blockers, attacks, count, magic, bits, table, stamps, stamp++);
+      if (span == 0)
+        continue;
+      found = 1;
+      if (search->spans[i] == 0 || span <= search->spans[i]) {
+        search->spans[i] = span;
+        search->results[i].magic = magic;
+        search->results[i].bits = bits;
+      }
+    }
+    /* fewer bits than relevant squares rarely works */
+    if (!found && bits <= count_bits(mask))
+      break;
+  }
+  free(table);
+  free(stamps);
+}
+
+static void *
+magic_worker(void *arg)
+{
+  struct magic_search *search;
+  int i;
+  search = arg;
+  while ( (i = __atomic_fetch_add(&search->next_square, 1, __ATOMIC_RELAXED)) < 128) {
+    find_magic(search, i);
+    if (search->spans[i] == 0) {
+      fprintf(stderr, "no magic found for square %d\n", i);
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+static void
+print_magics(const struct magic_search *search)
+{
+  int i;
+  printf("#include <stdint.h>\n");
+  printf("#include <stddef.h>\n");
+  printf("#include <assert.h>\n");
+  printf("#include <stdlib.h>\n");
+  printf("#include \"chess.h\"\n");
+  printf("const struct magic_square magic_squares[] = {\n");
+  for (i = 0; i < 128; i++) {
+    if (i % 64 == 0)
+      printf("  /* %s */\n", i ? "rooks" : "bishops");
+    printf("  [%3d] = {0x%016lx, %2d},\n", i, search->results[i].magic,
+        search->results[i].bits);
+  }
+  printf("};\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct magic_search search;
+  pthread_t *threads;
+  uint64_t *table;
+  int offsets[128];
+  int thread_count, size, i;
+  search.seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+  search.attempts = argc > 2 ? atoi(argv[2]) : DEFAULT_ATTEMPTS;
+  thread_count = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (thread_count < 1)
+    thread_count = 1;
+  search.next_square = 0;
+  init_relevance_masks();
+
+  threads = xmalloc(thread_count * sizeof(pthread_t));
+  for (i = 1; i < thread_count; i++)
+    if (pthread_create(&threads[i], NULL, magic_worker, &search)) {
+      perror("pthread_create");
+      exit(1);
+    }
+  magic_worker(&search);
+  for (i = 1; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  table = pack_magic_tables(search.results, offsets, &size);
+  assert(table);
+  free(table);
+  fprintf(stderr, "seed %lu: attack table of %d entries\n",
+      (unsigned long)search.seed, size);
+  print_magics(&search);
+  return 0;
+}
@@ -2,82 +2,557 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 #include <stdio.h>
+#include <math.h>
+#include <pthread.h>
 #include "chess.h"
 
+/*
+ * Lazy SMP: every thread runs its own iterative deepening search on a
+ * private copy of the board and they cooperate only through the shared
+ * transposition table. Helper threads start at staggered depths so they
+ * tend to fill the table ahead of the main thread, which alone owns the
+ * deadline and the returned move.
+ */
+struct search_thread {
+  struct board board;
+  struct move_order order;
+  struct nnue_accumulator *nnue;
+  pthread_t thread;
+  int id;
+  int root_depth;
+  /* ply of the last null move on the path, and the first ply that may
+   * try one while a null move is being verified */
+  int null_ply, null_min_ply;
+  long nodes;
+  long pawn_hits, pawn_misses;
+  long eval_hits, eval_misses;
+  long deadline;
+};
+
+/* a capture must be able to come this close to alpha to be searched */
+#define DELTA_MARGIN 200
+/* initial half width of the root window, and the width at which it opens fully */
+#define ASPIRATION_WINDOW 25
+#define ASPIRATION_MAX_WINDOW 400
+#define SEARCH_INFINITY (CHECKMATE_EVALUATION + 1)
+/*
+ * Frontier pruning margins by remaining depth, in centipawns: how much
+ * a quiet move can plausibly gain, and how far below alpha a node must
+ * be for razoring to drop it into quiescence.
+ */
+#define FRONTIER_DEPTH 3
+/* quiet moves are only skipped as futile this close to the horizon */
+#define FUTILITY_DEPTH 2
+static const int futility_margins[FRONTIER_DEPTH + 1] = { 0, 150, 300, 500 };
+static const int razor_margins[FRONTIER_DEPTH + 1] = { 0, 300, 500, 700 };
+/* null move depth reduction is NULL_MOVE_REDUCTION + depth / 4 */
+#define NULL_MOVE_REDUCTION 3
+/* null move cutoffs from this depth are verified by a normal search */
+#define NULL_MOVE_VERIFY_DEPTH 10
+/*
+ * Late moves are searched to a depth reduced by
+ * LMR_BASE + log(depth) * log(move_index) / LMR_DIVISOR, less for moves
+ * that give check, captures, killers and moves with good history.
+ */
+#define LMR_BASE 0.75
+#define LMR_DIVISOR 2.25
+/* moves searched at full depth before any is reduced */
+#define LMR_FULL_DEPTH_MOVES 3
+#define LMR_MIN_DEPTH 3
+#define LMR_GOOD_HISTORY 1024
+/* the main thread reads the clock once every this many nodes */
+#define TIME_CHECK_NODES 1024
+/* time kept back from the hard limit for printing the move */
+#define MOVE_OVERHEAD_MS 10
+
+/*
+ * The move time given to find_move() is a hard limit. A new iteration is
+ * only started while the elapsed time is under a soft target, a
+ * percentage of the move time that grows while the best move keeps
+ * changing or the score is falling and shrinks once the move settles.
+ */
+struct time_manager {
+  long start;
+  long milliseconds;
+  long hard_deadline;
+  int stable_iterations;
+  Move last_move;
+  int last_score;
+};
+
+#define SOFT_TIME_PERCENT 50
+#define UNSTABLE_TIME_PERCENT 30
+#define STABLE_TIME_PERCENT (-20)
+#define SCORE_DROP_TIME_PERCENT 30
+/* iterations with the same best move before it counts as stable */
+#define STABLE_ITERATIONS 3
+/* a fall of this many centipawns between iterations buys extra time */
+#define SCORE_DROP 50
+
+static int stop_search;
+static int reductions[MAX_SEARCH_PLY][64];
+
+/* milliseconds on a clock that is not affected by the number of threads */
+static long
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+time_manager_init(struct time_manager *tm, long milliseconds)
+{
+  tm->start = now_ms();
+  tm->milliseconds = milliseconds;
+  tm->hard_deadline = tm->start + milliseconds
+    - (milliseconds > 4 * MOVE_OVERHEAD_MS ? MOVE_OVERHEAD_MS : milliseconds / 4);
+  tm->stable_iterations = 0;
+  tm->last_move = 0;
+  tm->last_score = 0;
+}
+
+/* called after each completed iteration, returns whether to start another */
+static int
+time_manager_continue(struct time_manager *tm, Move move, int score)
+{
+  int percent;
+  if (move == tm->last_move)
+    tm->stable_iterations++;
+  else
+    tm->stable_iterations = 0;
+  percent = SOFT_TIME_PERCENT;
+  if (tm->stable_iterations == 0)
+    percent += UNSTABLE_TIME_PERCENT;
+  else if (tm->stable_iterations >= STABLE_ITERATIONS)
+    percent += STABLE_TIME_PERCENT;
+  if (tm->last_move && score <= tm->last_score - SCORE_DROP)
+    percent += SCORE_DROP_TIME_PERCENT;
+  if (percent > 100)
+    percent = 100;
+  tm->last_move = move;
+  tm->last_score = score;
+  return now_ms() - tm->start < tm->milliseconds * percent / 100;
+}
+
+/* only the main thread looks at the clock, every TIME_CHECK_NODES nodes */
+static void
+poll_deadline(struct search_thread *thread)
+{
+  if (thread->id == 0 && (thread->nodes & (TIME_CHECK_NODES - 1)) == 0
+  &&  now_ms() > thread->deadline)
+    __atomic_store_n(&stop_search, 1, __ATOMIC_RELAXED);
+}
+
 static int
-minimax(struct board *board, int depth, int cutoff_depth, int alpha, int beta,
-    Move *best_move, clock_t deadline)
+search_stopped(struct search_thread *thread)
 {
+  return __atomic_load_n(&stop_search, __ATOMIC_RELAXED);
+}
+
+/* static evaluation from the side to move's point of view */
+static int
+relative_evaluation(struct board *board)
+{
+  return board_turn(board) == COLOR_WHITE ? evaluate_board(board) : -evaluate_board(board);
+}
+
+/*
+ * Search captures and promotions only until the position is quiet, so
+ * the evaluation is never taken in the middle of an exchange. The side to
+ * move may always stand pat on the static evaluation, except in check
+ * where every evasion is searched.
+ */
+static int
+quiescence(struct search_thread *thread, int alpha, int beta)
+{
+  struct board *board;
+  struct position *pos;
   Move moves[256];
-  int col, move_count, i, best_score, score;
+  int scores[256];
+  int col, in_check, move_count, i, stand_pat, best_score, score, gain;
+  board = &thread->board;
+  pos = board_position(board);
+  thread->nodes++;
+  poll_deadline(thread);
   col = board_turn(board);
-  best_score = col ? -CHECKMATE_EVALUATION-1 : CHECKMATE_EVALUATION+1;
-  move_count = board_moves(board, moves, ~0);
-  if (move_count == 0) {
-    assert(best_move == NULL);
-    if (board_in_check(board))
-      return col ? -(CHECKMATE_EVALUATION - board->ply) : (CHECKMATE_EVALUATION - board->ply);
-    else
-      return 0;
+  in_check = board_in_check(board);
+  if (board->ply >= MAX_SEARCH_PLY - 1)
+    return relative_evaluation(board);
+
+  stand_pat = 0;
+  if (in_check) {
+    best_score = -SEARCH_INFINITY;
+    move_count = board_moves(board, moves, ~0);
+    if (move_count == 0)
+      return -(CHECKMATE_EVALUATION - board->ply);
+  } else {
+    stand_pat = best_score = relative_evaluation(board);
+    if (stand_pat >= beta)
+      return stand_pat;
+    if (stand_pat > alpha)
+      alpha = stand_pat;
+    move_count = board_moves(board, moves, GEN_FLAG_CAPTURES);
   }
+  score_moves(&thread->order, board, moves, scores, move_count);
+
   for (i = 0; i < move_count; i++) {
+    pick_move(moves, scores, i, move_count);
+    if (!in_check) {
+      /* under-promotions are never better than a queen */
+      if (move_special_type(moves[i]) == SPECIAL_MOVE_PROMOTE
+      &&  move_promote_piece(moves[i]) != PIECE_TYPE_QUEEN)
+        continue;
+      /* delta pruning: skip captures that can not reach alpha */
+      gain = (pos->color_bitboards[!col] & set_bit(move_dest(moves[i])))
+        ? piece_values[get_piece_type(pos->mailbox, move_dest(moves[i]))]
+        : piece_values[PIECE_TYPE_PAWN];
+      if (move_special_type(moves[i]) == SPECIAL_MOVE_PROMOTE)
+        gain += piece_values[PIECE_TYPE_QUEEN] - piece_values[PIECE_TYPE_PAWN];
+      if (stand_pat + gain + DELTA_MARGIN <= alpha)
+        continue;
+    }
     board_push(board, moves[i]);
-    if (board_is_repetition(board))
-      score = 0;
-    else if (depth == 0 || cutoff_depth == 0)
-      score = evaluate_board(board);
-    else
-      score = minimax(board, depth - (board_in_check(board) ? 0 : 1),
-          cutoff_depth - 1, alpha, beta, NULL, deadline);
+    score = -quiescence(thread, -beta, -alpha);
     board_pop(board, moves[i]);
-    if (board->ply < 4 && clock() > deadline) {
+    if (score > best_score) {
+      best_score = score;
+      if (score > alpha)
+        alpha = score;
+      if (score >= beta)
+        break;
+    }
+  }
+  return best_score;
+}
+
+/* fills the late move reduction table, once at startup */
+void
+init_search(void)
+{
+  int depth, index;
+  for (depth = 1; depth < MAX_SEARCH_PLY; depth++)
+    for (index = 1; index < 64; index++)
+      reductions[depth][index] = LMR_BASE + log(depth) * log(index) / LMR_DIVISOR;
+}
+
+/*
+ * Principal variation search in negamax form: scores are always from the
+ * point of view of the side to move. The first move is searched with the
+ * full window and the rest with a null window around alpha, re-searched
+ * only when they unexpectedly beat it. Late quiet moves are first
+ * searched to a reduced depth and only searched fully if they beat alpha.
+ */
+static int
+negamax(struct search_thread *thread, int depth, int alpha, int beta,
+    Move *best_move)
+{
+  struct board *board;
+  struct position *pos;
+  struct move_picker picker;
+  Move move, hash_move, node_best_move;
+  int move_count, best_score, score, child_depth, col;
+  int alpha_orig, tt_depth, tt_bound, tt_score;
+  int reduction, null_ply, verify, in_check, quiet, killer, history;
+  int static_eval, futile;
+  uint64_t hash;
+  if (depth <= 0 && best_move == NULL)
+    return quiescence(thread, alpha, beta);
+  board = &thread->board;
+  thread->nodes++;
+  poll_deadline(thread);
+  best_score = -SEARCH_INFINITY;
+  alpha_orig = alpha;
+  hash = board_hash(board);
+
+  hash_move = 0;
+  if (tt_probe(hash, board->ply, &hash_move, &tt_depth, &tt_bound, &tt_score)
+  &&  best_move == NULL && tt_depth >= depth) {
+    if (tt_bound == TT_BOUND_EXACT
+    || (tt_bound == TT_BOUND_LOWER && tt_score >= beta)
+    || (tt_bound == TT_BOUND_UPPER && tt_score <= alpha))
+      return tt_score;
+  }
+
+  pos = board_position(board);
+  col = board_turn(board);
+  in_check = board_in_check(board);
+  static_eval = in_check ? -SEARCH_INFINITY : relative_evaluation(board);
+
+  /*
+   * Frontier pruning near the horizon, at null window nodes only and
+   * never in check or around mate scores: fail high when the static eval
+   * is well above beta, drop into quiescence when it is far below alpha,
+   * and mark the quiet moves of the last two plies for futility pruning.
+   */
+  futile = 0;
+  if (best_move == NULL && beta - alpha == 1 && !in_check && depth <= FRONTIER_DEPTH
+  &&  abs(alpha) < CHECKMATE_EVALUATION - MAX_SEARCH_PLY
+  &&  abs(beta) < CHECKMATE_EVALUATION - MAX_SEARCH_PLY) {
+    if (static_eval - futility_margins[depth] >= beta)
+      return static_eval - futility_margins[depth];
+    if (static_eval + razor_margins[depth] <= alpha) {
+      score = quiescence(thread, alpha, beta);
+      if (depth == 1 || score <= alpha)
+        return score;
+    }
+    futile = depth <= FUTILITY_DEPTH && static_eval + futility_margins[depth] <= alpha;
+  }
+
+  /*
+   * Null move pruning: if passing the turn still fails high on a reduced
+   * search, some real move almost surely would too. Never in check, right
+   * after another null move, or with only pawns left, where passing could
+   * be the only way out of zugzwang. Deep cutoffs are verified by a
+   * normal reduced search that may not try null moves itself for a while.
+   */
+  if (best_move == NULL && beta - alpha == 1 && depth >= 2
+  &&  thread->null_ply != board->ply - 1 && board->ply >= thread->null_min_ply
+  &&  abs(beta) < CHECKMATE_EVALUATION - MAX_SEARCH_PLY
+  &&  (pos->color_bitboards[col] & ~pos->type_bitboards[PIECE_TYPE_PAWN]
+      & ~pos->type_bitboards[PIECE_TYPE_KING])
+  &&  !in_check && static_eval >= beta) {
+    reduction = NULL_MOVE_REDUCTION + depth / 4;
+    null_ply = thread->null_ply;
+    thread->null_ply = board->ply;
+    board_push_null(board);
+    score = -negamax(thread, depth - 1 - reduction, -beta, -beta + 1, NULL);
+    board_pop_null(board);
+    thread->null_ply = null_ply;
+    if (search_stopped(thread))
+      return 0;
+    if (score >= beta) {
+      /* a mate found after passing the turn proves nothing */
+      if (score >= CHECKMATE_EVALUATION - MAX_SEARCH_PLY)
+        score = beta;
+      if (depth < NULL_MOVE_VERIFY_DEPTH || thread->null_min_ply)
+        return score;
+      thread->null_min_ply = board->ply + 3 * (depth - 1 - reduction) / 4;
+      verify = negamax(thread, depth - 1 - reduction, beta - 1, beta, NULL);
+      thread->null_min_ply = 0;
+      if (verify >= beta)
+        return score;
+    }
+  }
+
+  node_best_move = 0;
+  init_move_picker(&picker, &thread->order, board, hash_move);
+  for (move_count = 0; (move = next_move(&picker, &thread->order, board)); move_count++) {
+    quiet = move_is_quiet(board, move);
+    /* the first move is always searched, so a mate is never missed */
+    if (futile && quiet && move_count > 0 && !board_gives_check(board, move)) {
+      /* the bound a full search of the move would most likely have given */
+      if (static_eval + futility_margins[depth] > best_score)
+        best_score = static_eval + futility_margins[depth];
+      continue;
+    }
+    killer = move == picker.killers[0] || move == picker.killers[1];
+    history = thread->order.history[col][move_origin(move)][move_dest(move)];
+    board_push(board, move);
+    /* extend checks, but not so far that the ply stack can run out */
+    child_depth = depth - 1
+      + (board->ply < 2 * thread->root_depth && board_in_check(board));
+    reduction = 0;
+    if (depth >= LMR_MIN_DEPTH && move_count >= LMR_FULL_DEPTH_MOVES && !in_check) {
+      reduction = reductions[depth < MAX_SEARCH_PLY ? depth : MAX_SEARCH_PLY - 1]
+        [move_count < 64 ? move_count : 63];
+      reduction -= board_in_check(board) + !quiet + killer
+        + (history >= LMR_GOOD_HISTORY) + (beta - alpha > 1);
+      if (reduction > child_depth - 1)
+        reduction = child_depth - 1;
+    }
+    if (board_is_draw(board)) {
+      score = 0;
+    } else if (move_count == 0) {
+      score = -negamax(thread, child_depth, -beta, -alpha, NULL);
+    } else {
+      score = alpha + 1;
+      if (reduction > 0)
+        score = -negamax(thread, child_depth - reduction, -alpha-1, -alpha, NULL);
+      if (score > alpha)
+        score = -negamax(thread, child_depth, -alpha-1, -alpha, NULL);
+      if (score > alpha && score < beta)
+        score = -negamax(thread, child_depth, -beta, -alpha, NULL);
+    }
+    board_pop(board, move);
+    if (search_stopped(thread)) {
       if (best_move != NULL )
         *best_move = 0;
       return 0;
     }
-    if (col) {
-      if (score > best_score) {
-        best_score = score;
+    if (score > best_score) {
+      best_score = score;
+      node_best_move = move;
+      if (best_move != NULL)
+        *best_move = move;
+      if (score > alpha)
         alpha = score;
-        if (best_move != NULL)
-          *best_move = moves[i];
-        if (score >= beta)
-          break;
-      }
-    } else {
-      if (score < best_score) {
-        best_score = score;
-        beta = score;
-        if (best_move != NULL)
-          *best_move = moves[i];
-        if (score <= alpha)
-          break;
+      if (score >= beta) {
+        record_cutoff(&thread->order, board, move, depth, move_count);
+        break;
       }
     }
   }
+  if (node_best_move == 0) {
+    assert(best_move == NULL);
+    if (in_check)
+      return -(CHECKMATE_EVALUATION - board->ply);
+    else
+      return 0;
+  }
+  tt_store(hash, board->ply, node_best_move, depth,
+      best_score <= alpha_orig ? TT_BOUND_UPPER
+      : best_score >= beta ? TT_BOUND_LOWER : TT_BOUND_EXACT,
+      best_score);
   return best_score;
 }
 
+/*
+ * Search the root to the given depth with a window centred on the score
+ * of the previous iteration, widening whichever side fails. The move is
+ * only kept once the score lands inside the window; it is 0 if the search
+ * was stopped first.
+ */
+static int
+aspiration_search(struct search_thread *thread, int depth, int prev_score,
+    Move *best_move)
+{
+  int alpha, beta, window, score;
+  thread->root_depth = depth;
+  alpha = -SEARCH_INFINITY;
+  beta = SEARCH_INFINITY;
+  window = ASPIRATION_WINDOW;
+  if (depth >= 4 && abs(prev_score) < CHECKMATE_EVALUATION - MAX_SEARCH_PLY) {
+    alpha = prev_score - window;
+    beta = prev_score + window;
+  }
+  for (;;) {
+    score = negamax(thread, depth, alpha, beta, best_move);
+    if (*best_move == 0)
+      return 0;
+    if (score > alpha && score < beta)
+      return score;
+    window *= 2;
+    if (score <= alpha)
+      alpha = window > ASPIRATION_MAX_WINDOW ? -SEARCH_INFINITY : score - window;
+    else
+      beta = window > ASPIRATION_MAX_WINDOW ? SEARCH_INFINITY : score + window;
+  }
+}
+
+static void *
+helper_search(void *arg)
+{
+  struct search_thread *thread;
+  Move move;
+  int depth, score;
+  thread = arg;
+  /* odd helpers skip ahead a ply */
+  depth = thread->id & 1;
+  score = 0;
+  do {
+    depth++;
+    score = aspiration_search(thread, depth, score, &move);
+  } while (!search_stopped(thread) && 2 * depth < MAX_SEARCH_PLY - 32);
+  pawn_table_counters(&thread->pawn_hits, &thread->pawn_misses);
+  eval_cache_counters(&thread->eval_hits, &thread->eval_misses);
+  free_pawn_table();
+  free_eval_cache();
+  return NULL;
+}
+
 Move
-find_move(struct board *board, int milliseconds, int verbose)
+find_move(struct board *board, int milliseconds, int thread_count, int verbose)
 {
+  struct search_thread *threads;
+  struct time_manager tm;
+  Move moves[256];
   Move best_move, move;
-  clock_t deadline, start_time;
-  int depth;
-  start_time = clock();
-  deadline = clock() + (milliseconds * CLOCKS_PER_SEC)/1000;
-  depth = 1;
-  move = 0;
-  do {
-    best_move = move;
+  long nodes, cutoffs, first_move_cutoffs, pawn_hits, pawn_misses, eval_hits, eval_misses;
+  int depth, score, i;
+  if (board_moves(board, moves, ~0) == 0)
+    return 0;
+  if (thread_count < 1)
+    thread_count = 1;
+  if ( (threads = aligned_alloc(64, thread_count * sizeof(struct search_thread))) == NULL) {
+    perror("aligned_alloc");
+    exit(1);
+  }
+  tt_new_search();
+  pawn_table_counters(&pawn_hits, &pawn_misses);
+  eval_cache_counters(&eval_hits, &eval_misses);
+  time_manager_init(&tm, milliseconds);
+  stop_search = 0;
+  for (i = 0; i < thread_count; i++) {
+    threads[i].board = *board;
+    threads[i].nnue = NULL;
+    if (nnue_enabled()) {
+      if ( (threads[i].nnue = aligned_alloc(64, MAX_SEARCH_PLY * sizeof(struct nnue_accumulator))) == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+      }
+      nnue_reset(&threads[i].board, threads[i].nnue);
+    }
+    threads[i].id = i;
+    threads[i].null_ply = -1;
+    threads[i].null_min_ply = 0;
+    threads[i].nodes = 0;
+    clear_move_order(&threads[i].order);
+    threads[i].deadline = tm.hard_deadline;
+  }
+  /* the first iteration always completes so there is a move to play */
+  threads[0].deadline = LONG_MAX;
+  for (i = 1; i < thread_count; i++)
+    if (pthread_create(&threads[i].thread, NULL, helper_search, &threads[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+
+  depth = 0;
+  score = 0;
+  best_move = 0;
+  for (;;) {
     depth++;
-    minimax(board, depth, depth + 4, -CHECKMATE_EVALUATION-1, CHECKMATE_EVALUATION+1, &move, deadline);
-    if (move && verbose)
-      printf("depth %d %ld\n", depth, (clock() - start_time) * 1000 / CLOCKS_PER_SEC);
-  } while(move);
+    score = aspiration_search(&threads[0], depth, score, &move);
+    if (move == 0)
+      break;
+    best_move = move;
+    threads[0].deadline = tm.hard_deadline;
+    if (verbose)
+      printf("depth %d %ld %ld\n", depth, now_ms() - tm.start, threads[0].nodes);
+    if (2 * depth >= MAX_SEARCH_PLY - 32 || !time_manager_continue(&tm, move, score))
+      break;
+  }
+
+  __atomic_store_n(&stop_search, 1, __ATOMIC_RELAXED);
+  pawn_table_counters(&threads[0].pawn_hits, &threads[0].pawn_misses);
+  eval_cache_counters(&threads[0].eval_hits, &threads[0].eval_misses);
+  for (i = 1; i < thread_count; i++)
+    pthread_join(threads[i].thread, NULL);
+  nodes = cutoffs = first_move_cutoffs = pawn_hits = pawn_misses = 0;
+  eval_hits = eval_misses = 0;
+  for (i = 0; i < thread_count; i++) {
+    nodes += threads[i].nodes;
+    cutoffs += threads[i].order.cutoffs;
+    first_move_cutoffs += threads[i].order.first_move_cutoffs;
+    pawn_hits += threads[i].pawn_hits;
+    pawn_misses += threads[i].pawn_misses;
+    eval_hits += threads[i].eval_hits;
+    eval_misses += threads[i].eval_misses;
+    free(threads[i].nnue);
+  }
+  if (verbose)
+    printf("threads %d nodes %ld time %ld first move cutoffs %.1f%% pawn hits %.1f%%"
+        " eval hits %.1f%%\n",
+        thread_count, nodes, now_ms() - tm.start,
+        cutoffs ? 100.0 * first_move_cutoffs / cutoffs : 0.0,
+        pawn_hits + pawn_misses ? 100.0 * pawn_hits / (pawn_hits + pawn_misses) : 0.0,
+        eval_hits + eval_misses ? 100.0 * eval_hits / (eval_hits + eval_misses) : 0.0);
+  free(threads);
   assert(best_move);
-  /* TODO: handle case when no move found before deadline */
   return best_move;
 }
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#define GENERATING_ATTACK_TABLES
+#include "chess.h"
+
+/*
+ * Build step that computes every lookup table for sliding, knight and
+ * king attacks and prints them as constant C data, so the engine starts
+ * without any table initialisation and the tables live in read-only pages
+ * shared between processes. build.sh compiles and runs it before the
+ * engine itself.
+ *
+ * The magic numbers come from magic_numbers.c, see find_magics.c to
+ * search for new ones.
+ *
+ * usage: generate_attack_tables > attack_tables.c
+ */
+
+#define PEXT_TABLE_SIZE 107648
+
+static uint64_t knight_attack_table[64];
+static uint64_t king_attack_table[64];
+static uint64_t *attack_table;
+static int attack_table_size;
+static int magic_offsets[128];
+static uint64_t pext_attack_table[PEXT_TABLE_SIZE];
+static int pext_offsets[128];
+
+static void
+init_knight_attack_table(void)
+{
+  int i, j;
+  const int moves[] = {-17, -15, -10, -6, 6, 10, 15, 17};
+  for (i = 0; i < 64; i++) {
+    knight_attack_table[i] = 0;
+    for (j = 0; j < sizeof(moves) / sizeof(moves[0]); j++)
+      if (abs(i % 8 - (i + moves[j]) % 8) <= 2 && square_valid(i + moves[j]))
+        knight_attack_table[i] |= set_bit(i + moves[j]);
+  }
+}
+
+static void
+init_king_attack_table(void)
+{
+  int i, j;
+  const int moves[] = {-9, -8, -7, -1, 1, 7, 8, 9};
+  for (i = 0; i < 64; i++) {
+    king_attack_table[i] = 0;
+    for (j = 0; j < sizeof(moves) / sizeof(moves[0]); j++)
+      if (abs(i % 8 - (i + moves[j]) % 8) <= 1 && square_valid(i + moves[j]))
+        king_attack_table[i] |= set_bit(i + moves[j]);
+  }
+}
+
+/* software pext: gathers the bits of src selected by mask */
+static uint64_t
+software_pext(uint64_t src, uint64_t mask)
+{
+  uint64_t result, bit;
+  int i;
+  result = 0;
+  for (i = 0; mask; i++) {
+    bit = pop_lsb(&mask);
+    if (src & bit)
+      result |= (uint64_t)1 << i;
+  }
+  return result;
+}
+
+static void
+init_pext_tables(void)
+{
+  uint64_t relevance_mask, blockers;
+  int i, square, rook, offset, index;
+  offset = 0;
+  for (i = 0; i < 128; i++) {
+    square = i % 64;
+    rook = i > 63;
+    relevance_mask = rook ? rook_relevance_masks[square] : bishop_relevance_masks[square];
+    pext_offsets[i] = offset;
+    for (index = 0; index < (1 << count_bits(relevance_mask)); index++) {
+      blockers = generate_mock_blockers(relevance_mask, index);
+      pext_attack_table[offset + software_pext(blockers, relevance_mask)] = rook
+        ? primitive_rook_attack_squares(square, blockers)
+        : primitive_bishop_attack_squares(square, blockers);
+    }
+    offset += 1 << count_bits(relevance_mask);
+  }
+  if (offset != PEXT_TABLE_SIZE) {
+    fprintf(stderr, "pext tables need %d entries, not %d\n", offset, PEXT_TABLE_SIZE);
+    exit(1);
+  }
+}
+
+static void
+print_bitboards(const char *qualifiers, const char *name, const uint64_t *table,
+    int count)
+{
+  int i;
+  printf("%sconst uint64_t %s[%d] = {", qualifiers, name, count);
+  for (i = 0; i < count; i++)
+    printf("%s0x%016lx,", i % 4 ? " " : "\n  ", table[i]);
+  printf("\n};\n");
+}
+
+static void
+print_tables(void)
+{
+  int i;
+  printf("/* generated by src/generate_attack_tables.c, do not edit */\n");
+  printf("#include <stdint.h>\n");
+  printf("#include <stddef.h>\n");
+  printf("#include <assert.h>\n");
+  printf("#include <stdlib.h>\n");
+  printf("#include \"chess.h\"\n");
+  print_bitboards("", "knight_attack_table", knight_attack_table, 64);
+  print_bitboards("", "king_attack_table", king_attack_table, 64);
+  print_bitboards("static ", "attack_table", attack_table, attack_table_size);
+  print_bitboards("static ", "pext_attack_table", pext_attack_table, PEXT_TABLE_SIZE);
+  for (i = 0; i < 128; i++) {
+    if (i % 64 == 0)
+      printf("const struct magic_entry %s_magics[64] = {\n", i ? "rook" : "bishop");
+    printf("  {0x%016lx, 0x%016lx, attack_table + %6d, %2d},\n",
+        i > 63 ? rook_relevance_masks[i % 64] : bishop_relevance_masks[i],
+        magic_squares[i].magic, magic_offsets[i], 64 - magic_squares[i].bits);
+    if (i % 64 == 63)
+      printf("};\n");
+  }
+  for (i = 0; i < 128; i++) {
+    if (i % 64 == 0)
+      printf("const struct magic_entry %s_pexts[64] = {\n", i ? "rook" : "bishop");
+    printf("  {0x%016lx, 0, pext_attack_table + %6d, 0},\n",
+        i > 63 ? rook_relevance_masks[i % 64] : bishop_relevance_masks[i],
+        pext_offsets[i]);
+    if (i % 64 == 63)
+      printf("};\n");
+  }
+}
+
+int
+main(void)
+{
+  init_relevance_masks();
+  attack_table = pack_magic_tables(magic_squares, magic_offsets, &attack_table_size);
+  if (attack_table == NULL) {
+    fprintf(stderr, "magic_numbers.c holds a magic number that does not work\n");
+    return 1;
+  }
+  init_pext_tables();
+  init_knight_attack_table();
+  init_king_attack_table();
+  print_tables();
+  return 0;
+}
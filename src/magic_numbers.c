@@ -3,136 +3,135 @@
 #include <assert.h>
 #include <stdlib.h>
 #include "chess.h"
-struct magic_square magic_squares[] = {
+const struct magic_square magic_squares[] = {
   /* bishops */
-  [  0] = {0x3020450208204080,  6, 0},
-  [  1] = {0x00e008021480200a,  5, 64},
-  [  2] = {0x0488020410288083,  5, 96},
-  [  3] = {0x0008048109000003,  5, 128},
-  [  4] = {0x0001104120000900,  5, 160},
-  [  5] = {0x4900901048008b00,  5, 192},
-  [  6] = {0x00040208050410a2,  5, 224},
-  [  7] = {0x0001018050021080,  6, 256},
-  [  8] = {0x0000102208433400,  5, 320},
-  [  9] = {0x1182100101010201,  5, 352},
-  [ 10] = {0x0008940840890061,  5, 384},
-  [ 11] = {0x4010180a00a800c0,  5, 416},
-  [ 12] = {0x420a011040412100,  5, 448},
-  [ 13] = {0x0260060814040820,  5, 480},
-  [ 14] = {0x0504084802092000,  5, 512},
-  [ 15] = {0x0000020100a80400,  5, 544},
-  [ 16] = {0x0005001004880800,  5, 576},
-  [ 17] = {0x0008082001010a11,  5, 608},
-  [ 18] = {0x0022000404040088,  7, 640},
-  [ 19] = {0x00ca080422020020,  7, 768},
-  [ 20] = {0x4080800840808004,  8, 896},
-  [ 21] = {0x0002000022092000,  7, 1026},
-  [ 22] = {0x0201000411011000,  5, 1154},
-  [ 23] = {0x0080800064040600,  5, 1186},
-  [ 24] = {0x0c108a0044181020,  5, 1218},
-  [ 25] = {0x2885200018020410,  5, 1250},
-  [ 26] = {0x0010280810108024,  7, 1282},
-  [ 27] = {0x080400400020224e, 10, 1410},
-  [ 28] = {0x004100c004004040,  9, 2337},
-  [ 29] = {0x0010810002004200,  7, 2849},
-  [ 30] = {0x0202020000651010,  5, 2977},
-  [ 31] = {0x2201410008809820,  5, 3009},
-  [ 32] = {0x4028082800422260,  5, 3041},
-  [ 33] = {0x2404014400208400,  5, 3073},
-  [ 34] = {0x040400a200240400,  7, 3105},
-  [ 35] = {0x0c02084040094002, 10, 3233},
-  [ 36] = {0x2820002009008080, 10, 4101},
-  [ 37] = {0x1e04080830060100,  7, 4613},
-  [ 38] = {0x0441340400150b40,  5, 4741},
-  [ 39] = {0x0800890200025201,  5, 4773},
-  [ 40] = {0x040108080c024000,  5, 4805},
-  [ 41] = {0x0402012108082014,  5, 4837},
-  [ 42] = {0x000700c022081000,  7, 4869},
-  [ 43] = {0x1000000820800810,  8, 4997},
-  [ 44] = {0x0001088300400c00,  7, 5190},
-  [ 45] = {0x2082602141008080,  7, 5318},
-  [ 46] = {0x0008080104000040,  5, 5446},
-  [ 47] = {0x2010051040810100,  5, 5478},
-  [ 48] = {0x0100481228200080,  5, 5510},
-  [ 49] = {0x08060882480a200a,  5, 5542},
-  [ 50] = {0x0448086108081212,  5, 5574},
-  [ 51] = {0x0208000020a80400,  5, 5606},
-  [ 52] = {0x000c25406282010a,  5, 5638},
-  [ 53] = {0x0000556004410000,  5, 5670},
-  [ 54] = {0x2890600808e08220,  5, 5702},
-  [ 55] = {0x0220010101010920,  5, 5734},
-  [ 56] = {0x00a4838c01a00404,  6, 5766},
-  [ 57] = {0x2100404408943000,  5, 5830},
-  [ 58] = {0x0030000820941008,  5, 5862},
-  [ 59] = {0x00c0200010420601,  5, 5894},
-  [ 60] = {0x00884040040d0404,  5, 5926},
-  [ 61] = {0x010012a034090211,  5, 5958},
-  [ 62] = {0x0c0020c8102120c0,  5, 5990},
-  [ 63] = {0x0046a008010901aa,  6, 6022},
+  [  0] = {0x0050200204014156,  6},
+  [  1] = {0x14e0881100508000,  5},
+  [  2] = {0x1810008081018200,  5},
+  [  3] = {0x6104040080440e14,  5},
+  [  4] = {0x0804042000480002,  5},
+  [  5] = {0x0600822020008210,  5},
+  [  6] = {0x18240a03100a0200,  5},
+  [  7] = {0x0042020044440402,  6},
+  [  8] = {0x0c02220650e10c42,  5},
+  [  9] = {0x1000302ca8148020,  5},
+  [ 10] = {0xa010641800a10047,  5},
+  [ 11] = {0x104048060c440220,  5},
+  [ 12] = {0x10c00e1210040890,  5},
+  [ 13] = {0x1003288e206020a2,  5},
+  [ 14] = {0x0800044c10280800,  5},
+  [ 15] = {0x2040110108128a02,  5},
+  [ 16] = {0x0248882088b04082,  5},
+  [ 17] = {0x4851282214080082,  5},
+  [ 18] = {0x00881010002141d0,  7},
+  [ 19] = {0x00080000820244c4,  7},
+  [ 20] = {0x2204000284a01120,  7},
+  [ 21] = {0x880a000108021280,  7},
+  [ 22] = {0x0002044888045260,  5},
+  [ 23] = {0x44010000808801a8,  5},
+  [ 24] = {0x0220980020024400,  5},
+  [ 25] = {0x0004200004c80180,  5},
+  [ 26] = {0x8020300482040440,  7},
+  [ 27] = {0x20460060080080a0,  9},
+  [ 28] = {0x502a840010812004,  9},
+  [ 29] = {0x0068004052010088,  7},
+  [ 30] = {0x11a80a0201048211,  5},
+  [ 31] = {0x002702404b040080,  5},
+  [ 32] = {0x0004842008042002,  5},
+  [ 33] = {0x0802100420900168,  5},
+  [ 34] = {0x1484280800840024,  7},
+  [ 35] = {0x0120200800010050,  9},
+  [ 36] = {0x0c4b080200622200,  9},
+  [ 37] = {0x002000c100408080,  7},
+  [ 38] = {0x03108c0240008a08,  5},
+  [ 39] = {0x0001004480230400,  5},
+  [ 40] = {0x0001102632042000,  5},
+  [ 41] = {0x0802080c04040a80,  5},
+  [ 42] = {0x1401420050000301,  7},
+  [ 43] = {0x8508002014421800,  7},
+  [ 44] = {0x1810404181210a00,  7},
+  [ 45] = {0x8214200082081101,  7},
+  [ 46] = {0x260a080514040300,  5},
+  [ 47] = {0x60060120c0380200,  5},
+  [ 48] = {0x8500421010080040,  5},
+  [ 49] = {0x0009040111080052,  5},
+  [ 50] = {0x0800416219300802,  5},
+  [ 51] = {0x0000280446080106,  5},
+  [ 52] = {0x8400001082120000,  5},
+  [ 53] = {0x58100810300c82c0,  5},
+  [ 54] = {0xe0c1420404008880,  5},
+  [ 55] = {0x04cb220401020008,  5},
+  [ 56] = {0x0002208c00a01000,  6},
+  [ 57] = {0x8000220042080400,  5},
+  [ 58] = {0x2030020184480841,  5},
+  [ 59] = {0x2002010008940400,  5},
+  [ 60] = {0x4000001032420211,  5},
+  [ 61] = {0x180010c810410208,  5},
+  [ 62] = {0x0002211401481310,  5},
+  [ 63] = {0x4231200842204840,  6},
   /* rooks */
-  [ 64] = {0x0040089000c00061, 13, 6086},
-  [ 65] = {0x0040100040002000, 11, 14062},
-  [ 66] = {0x0060040008012020, 12, 16110},
-  [ 67] = {0x4200089004440200, 12, 19741},
-  [ 68] = {0x0040010400020800, 12, 23823},
-  [ 69] = {0x0180008001220044, 12, 27863},
-  [ 70] = {0x0040104000800102, 12, 31935},
-  [ 71] = {0x0c80084061000080, 12, 34055},
-  [ 72] = {0x0098800330804002, 11, 38151},
-  [ 73] = {0x1140400420100840, 10, 40199},
-  [ 74] = {0x0c22003200804222, 10, 41223},
-  [ 75] = {0x0000901000220080, 11, 42247},
-  [ 76] = {0x0201000800050010, 10, 43975},
-  [ 77] = {0x0804808002000400, 10, 44999},
-  [ 78] = {0x20020028011c0200, 10, 46023},
-  [ 79] = {0x0445800100024280, 11, 47047},
-  [ 80] = {0x0180044002200050, 11, 49095},
-  [ 81] = {0x2102011004008090, 11, 51143},
-  [ 82] = {0x0090402020800800, 11, 52567},
-  [ 83] = {0x0018808010010802, 10, 54511},
-  [ 84] = {0x0000808004021800, 10, 55535},
-  [ 85] = {0x4002008100800400, 10, 56559},
-  [ 86] = {0x2000840001100208, 10, 57583},
-  [ 87] = {0x2100004100008008, 12, 58607},
-  [ 88] = {0x2180005840006000, 11, 62262},
-  [ 89] = {0x004040a04000900c, 11, 64310},
-  [ 90] = {0x4010280020200028, 11, 65862},
-  [ 91] = {0x0810000808008100, 10, 67791},
-  [ 92] = {0x0006020040040040, 11, 68815},
-  [ 93] = {0x0010200408010008, 11, 70607},
-  [ 94] = {0x0480080400820130, 10, 71892},
-  [ 95] = {0x6201000041008408, 12, 72916},
-  [ 96] = {0x1000c00029800080, 11, 76603},
-  [ 97] = {0x6080802001080013, 11, 78651},
-  [ 98] = {0x6000a08602001040, 10, 80326},
-  [ 99] = {0x0100800800801000, 10, 81350},
-  [100] = {0x0000228040400804, 11, 82374},
-  [101] = {0x0022400100404012, 11, 83992},
-  [102] = {0x1408020401000280, 11, 85097},
-  [103] = {0x0001801840801100, 11, 86885},
-  [104] = {0x0000204000808008, 11, 88933},
-  [105] = {0x001d500020004000, 10, 90981},
-  [106] = {0x0800402001010014, 10, 92005},
-  [107] = {0x0402100004c02020, 11, 93029},
-  [108] = {0x0088080040040802, 11, 94617},
-  [109] = {0x0220020010041001, 11, 96156},
-  [110] = {0x2201082420810002, 11, 97699},
-  [111] = {0x4001002060005008, 12, 99123},
-  [112] = {0x0121014420800300, 11, 102896},
-  [113] = {0x5000804000600180, 10, 104944},
-  [114] = {0x1000344020010100, 10, 105968},
-  [115] = {0x4200500048008080, 10, 106992},
-  [116] = {0x00c1000800545100, 10, 108016},
-  [117] = {0x0100800200040080, 10, 109040},
-  [118] = {0x0009000600040100, 10, 110064},
-  [119] = {0x0001000040200020, 12, 111088},
-  [120] = {0x400011002a408003, 12, 114161},
-  [121] = {0x0040028024450011, 11, 118257},
-  [122] = {0x4820120028804122, 11, 120305},
-  [123] = {0x0000180410402156, 12, 122353},
-  [124] = {0x00040c0805102002, 12, 126392},
-  [125] = {0x1100108824400201, 12, 130244},
-  [126] = {0x0008008408004102, 12, 134308},
-  [127] = {0x0001040108208142, 12, 138148},
+  [ 64] = {0x0080024004211280, 12},
+  [ 65] = {0x004000700cc06000, 11},
+  [ 66] = {0x0200203040808a00, 11},
+  [ 67] = {0x41002100c8100004, 11},
+  [ 68] = {0x0200020060080490, 11},
+  [ 69] = {0x0180120004008021, 11},
+  [ 70] = {0x0200060000842803, 11},
+  [ 71] = {0x020002040880a041, 12},
+  [ 72] = {0x80a8800494400260, 11},
+  [ 73] = {0x0028c01000402000, 10},
+  [ 74] = {0x0100801000a00882, 10},
+  [ 75] = {0x010900100100232a, 10},
+  [ 76] = {0x2080800400080080, 10},
+  [ 77] = {0x0006001046000804, 10},
+  [ 78] = {0x0282004801040200, 10},
+  [ 79] = {0x5408800100006080, 11},
+  [ 80] = {0x1120208000400080, 11},
+  [ 81] = {0x0020044002c23000, 10},
+  [ 82] = {0x0000420024801200, 10},
+  [ 83] = {0x0102020021700840, 10},
+  [ 84] = {0x0000910025000800, 10},
+  [ 85] = {0x0041010024000208, 10},
+  [ 86] = {0x2004040030020508, 10},
+  [ 87] = {0x0122020002410184, 11},
+  [ 88] = {0x0081902080084001, 11},
+  [ 89] = {0x01004004c0201001, 10},
+  [ 90] = {0x0210008080200490, 10},
+  [ 91] = {0x0004700500200900, 10},
+  [ 92] = {0x00010011000c0801, 10},
+  [ 93] = {0x0001040080800200, 10},
+  [ 94] = {0x2480010400281610, 10},
+  [ 95] = {0x0409008200130844, 11},
+  [ 96] = {0x0009400880800c20, 11},
+  [ 97] = {0x4040010681004020, 10},
+  [ 98] = {0x0084900880802000, 10},
+  [ 99] = {0x0110100180802800, 10},
+  [100] = {0x0004008008080040, 10},
+  [101] = {0x20040020040110a8, 10},
+  [102] = {0x2004500204000108, 10},
+  [103] = {0x8244484082000401, 11},
+  [104] = {0x840480a240118000, 11},
+  [105] = {0x00c0402010004000, 10},
+  [106] = {0x0000300020008080, 10},
+  [107] = {0x0090000800808014, 10},
+  [108] = {0x8d02000408220011, 10},
+  [109] = {0x0182004c11060008, 10},
+  [110] = {0x403010410a040008, 10},
+  [111] = {0x2091228902420004, 11},
+  [112] = {0x4000288000c00280, 11},
+  [113] = {0x0100802008400480, 10},
+  [114] = {0x2400184300200100, 10},
+  [115] = {0x1005042008500100, 10},
+  [116] = {0x8004080180840080, 10},
+  [117] = {0x1400060014008080, 10},
+  [118] = {0x05200110e8020400, 10},
+  [119] = {0x0200042285410200, 11},
+  [120] = {0x2400402680001301, 12},
+  [121] = {0x010e544001810021, 11},
+  [122] = {0x010249104104a001, 11},
+  [123] = {0x410a000884a01042, 11},
+  [124] = {0x0711002800160411, 11},
+  [125] = {0x002b0004000a0841, 11},
+  [126] = {0x0081000486000401, 11},
+  [127] = {0x0248488044042502, 12},
 };
-uint64_t attack_table[142244];
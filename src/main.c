@@ -2,36 +2,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
 #include "chess.h"
 
 #include <stdio.h>
 
 #define DEFAULT_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 
-static long
-perft(struct board *board, int depth, int gen_flags, int print)
-{
-  Move moves[256];
-  long sum;
-  int move_count, c, i;
-  if (depth == 0)
-    return 1;
-  move_count = board_moves(board, moves, gen_flags);
-  if (move_count == 0 && print)
-    printf("\n");
-  sum = 0;
-  for (i = 0; i < move_count; i++) {
-    board_push(board, moves[i]);
-    c = perft(board, depth - 1, gen_flags, 0);
-    board_pop(board, moves[i]);
-    if (print) {
-      print_move(moves[i]);
-      printf(":%d%c", c, i == move_count - 1 ? '\n' : ' ');
-    }
-    sum += c;
-  }
-  return sum;
-}
+static int thread_count;
 
 static void
 tok_int(int *v, int *err)
@@ -82,6 +60,97 @@ tok_char(char *c, int *err)
   *c = s[0];
 }
 
+/* the static evaluation the search would use, from white's point of view */
+static void
+print_evaluation(struct board *board)
+{
+  struct nnue_accumulator *stack;
+  stack = NULL;
+  if (nnue_enabled()) {
+    if ( (stack = aligned_alloc(64, MAX_SEARCH_PLY * sizeof(struct nnue_accumulator))) == NULL) {
+      perror("aligned_alloc");
+      exit(1);
+    }
+    nnue_reset(board, stack);
+  }
+  printf("%d\n", evaluate_board(board));
+  free(stack);
+}
+
+/*
+ * Scores a file of fens, one per line, with evaluate_batch() and prints
+ * the scores on one line. An empty line is printed if the file can not
+ * be read.
+ */
+static void
+print_batch_evaluation(const char *path)
+{
+  struct position_batch batch;
+  struct position *pos;
+  struct board board;
+  Bitboard *rows, *columns;
+  FILE *f;
+  char *line, *end;
+  size_t size;
+  int *scores;
+  int count, capacity, err, i, j;
+  if ( (f = fopen(path, "r")) == NULL) {
+    perror(path);
+    printf("\n");
+    return;
+  }
+  rows = NULL;
+  line = NULL;
+  size = 0;
+  count = capacity = err = 0;
+  while (getline(&line, &size, f) != -1) {
+    if ( (end = strchr(line, '\n')) ) *end = '\0';
+    if (line[0] == '\0')
+      continue;
+    if (create_board(&board, line)) {
+      fprintf(stderr, "%s: invalid fen '%s'\n", path, line);
+      err = 1;
+      break;
+    }
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      rows = xrealloc(rows, capacity * 8 * sizeof(Bitboard));
+    }
+    pos = board_position(&board);
+    for (j = 0; j < 6; j++)
+      rows[count * 8 + j] = pos->type_bitboards[j];
+    for (j = 0; j < 2; j++)
+      rows[count * 8 + 6 + j] = pos->color_bitboards[j];
+    count++;
+  }
+  free(line);
+  fclose(f);
+  if (err) {
+    free(rows);
+    printf("\n");
+    return;
+  }
+
+  /* evaluate_batch() takes an array per bitboard */
+  columns = xmalloc((count ? count : 1) * 8 * sizeof(Bitboard));
+  scores = xmalloc((count ? count : 1) * sizeof(int));
+  for (i = 0; i < count; i++)
+    for (j = 0; j < 8; j++)
+      columns[j * count + i] = rows[i * 8 + j];
+  batch.count = count;
+  for (j = 0; j < 6; j++)
+    batch.type_bitboards[j] = columns + j * count;
+  for (j = 0; j < 2; j++)
+    batch.color_bitboards[j] = columns + (6 + j) * count;
+  evaluate_batch(&batch, scores);
+  for (i = 0; i < count; i++)
+    printf(i ? " %d" : "%d", scores[i]);
+  printf("\n");
+  free(rows);
+  free(columns);
+  free(scores);
+}
+
 static void
 repl_command(char *command)
 {
@@ -98,16 +167,44 @@ repl_command(char *command)
     tok_int(&d1, &err);
     tok_char(&v, &err);
     if (err) goto invalid_command;
-    move = find_move(&board, d1, v == 'v');
-    print_move(move);
+    move = find_move(&board, d1, thread_count, v == 'v');
+    /* no legal moves, print a null move */
+    if (move == 0)
+      printf("0000");
+    else
+      print_move(move);
     printf("\n");
+  } else if (strcmp(cmd, "eval") == 0) {
+    tok_fen(&board, &err);
+    if (err) goto invalid_command;
+    print_evaluation(&board);
+  } else if (strcmp(cmd, "evalbatch") == 0) {
+    if ( (cmd = strtok(NULL, "")) == NULL)
+      goto invalid_command;
+    print_batch_evaluation(cmd);
   } else if (strcmp(cmd, "perft") == 0) {
     tok_fen(&board, &err);
     tok_int(&d1, &err);
     tok_char(&c, &err);
     if (err) goto invalid_command;
-    perft(&board, d1, c == 'q' ? ~GEN_FLAG_CAPTURES : ~0, 1);
-  }  else {
+    perft(&board, d1, c == 'q' ? ~GEN_FLAG_CAPTURES : ~0, thread_count);
+  } else if (strcmp(cmd, "nnue") == 0) {
+    /* the rest of the line is the path, which may hold a ':' */
+    if ( (cmd = strtok(NULL, "")) == NULL)
+      goto invalid_command;
+    /* a network that fails to load leaves the classical evaluation */
+    if (nnue_load(cmd)) {
+      nnue_unload();
+      fprintf(stderr, "using the classical evaluation\n");
+    }
+    /* scores from the previous evaluation must not be reused */
+    tt_clear();
+    free_eval_cache();
+  } else if (strcmp(cmd, "threads") == 0) {
+    tok_int(&d1, &err);
+    if (err || d1 < 1) goto invalid_command;
+    thread_count = d1;
+  } else {
     goto invalid_command;
   }
   return;
@@ -119,20 +216,26 @@ invalid_command:
 void
 repl_start(void)
 {
-  char buffer[MAX_FEN_SIZE + 1];
-  for (;;) {
-    if (fgets(buffer, sizeof(buffer), stdin) == NULL)
-      break;
-    repl_command(buffer);
+  char *line;
+  size_t size;
+  line = NULL;
+  size = 0;
+  /* whole lines, however long */
+  while (getline(&line, &size, stdin) != -1) {
+    repl_command(line);
     fflush(stdout);
   }
+  free(line);
 }
 
 int
 main(int argc, char **argv)
 {
-  /* print_best_magics(); */
   init_bitboards();
+  init_search();
+  thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (thread_count < 1)
+    thread_count = 1;
   printf("READY\n");
   fflush(stdout);
   repl_start();
@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chess.h"
+
+/*
+ * Moves are scored once when generated and then picked best first with a
+ * selection pass, so nodes that cut off early never sort the whole list.
+ * Captures beat killers, which beat quiet moves ordered by history.
+ */
+#define SCORE_CAPTURE (1 << 28)
+#define SCORE_KILLER  (1 << 27)
+#define HISTORY_LIMIT (1 << 20)
+
+enum {
+  STAGE_HASH_MOVE,
+  STAGE_GENERATE_CAPTURES,
+  STAGE_CAPTURES,
+  STAGE_KILLERS,
+  STAGE_GENERATE_QUIETS,
+  STAGE_QUIETS,
+  STAGE_DONE,
+};
+
+static const int order_values[] = {
+  [PIECE_TYPE_PAWN]   = 1,
+  [PIECE_TYPE_KNIGHT] = 3,
+  [PIECE_TYPE_BISHOP] = 3,
+  [PIECE_TYPE_ROOK]   = 5,
+  [PIECE_TYPE_QUEEN]  = 9,
+  [PIECE_TYPE_KING]   = 10,
+};
+
+int
+move_is_quiet(struct board *board, Move move)
+{
+  struct position *pos;
+  pos = board_position(board);
+  return move_special_type(move) != SPECIAL_MOVE_PROMOTE
+    && move_special_type(move) != SPECIAL_MOVE_EN_PASSANT
+    && (pos->color_bitboards[!board_turn(board)] & set_bit(move_dest(move))) == 0;
+}
+
+void
+clear_move_order(struct move_order *order)
+{
+  memset(order, 0, sizeof(*order));
+}
+
+void
+score_moves(struct move_order *order, struct board *board, Move *moves,
+    int *scores, int count)
+{
+  struct position *pos;
+  Move *killers;
+  int col, i, victim, attacker;
+  pos = board_position(board);
+  col = board_turn(board);
+  killers = order->killers[board->ply];
+  for (i = 0; i < count; i++) {
+    if (!move_is_quiet(board, moves[i])) {
+      /* most valuable victim, least valuable attacker */
+      attacker = get_piece_type(pos->mailbox, move_origin(moves[i]));
+      if (pos->color_bitboards[!col] & set_bit(move_dest(moves[i])))
+        victim = order_values[get_piece_type(pos->mailbox, move_dest(moves[i]))];
+      else if (move_special_type(moves[i]) == SPECIAL_MOVE_EN_PASSANT)
+        victim = order_values[PIECE_TYPE_PAWN];
+      else
+        victim = 0;
+      if (move_special_type(moves[i]) == SPECIAL_MOVE_PROMOTE)
+        victim += order_values[move_promote_piece(moves[i])];
+      scores[i] = SCORE_CAPTURE + victim * 16 - order_values[attacker];
+    } else if (moves[i] == killers[0]) {
+      scores[i] = SCORE_KILLER + 1;
+    } else if (moves[i] == killers[1]) {
+      scores[i] = SCORE_KILLER;
+    } else {
+      scores[i] = order->history[col][move_origin(moves[i])][move_dest(moves[i])];
+    }
+  }
+}
+
+/* swaps the best remaining move into position index */
+Move
+pick_move(Move *moves, int *scores, int index, int count)
+{
+  Move move;
+  int best, i, score;
+  best = index;
+  for (i = index + 1; i < count; i++)
+    if (scores[i] > scores[best])
+      best = i;
+  move = moves[best];
+  moves[best] = moves[index];
+  moves[index] = move;
+  score = scores[best];
+  scores[best] = scores[index];
+  scores[index] = score;
+  return move;
+}
+
+void
+record_cutoff(struct move_order *order, struct board *board, Move move,
+    int depth, int move_index)
+{
+  Move *killers;
+  int col, origin, dest;
+  order->cutoffs++;
+  if (move_index == 0)
+    order->first_move_cutoffs++;
+  if (!move_is_quiet(board, move))
+    return;
+  killers = order->killers[board->ply];
+  if (killers[0] != move) {
+    killers[1] = killers[0];
+    killers[0] = move;
+  }
+  col = board_turn(board);
+  origin = move_origin(move);
+  dest = move_dest(move);
+  order->history[col][origin][dest] += depth * depth + 1;
+  if (order->history[col][origin][dest] >= HISTORY_LIMIT)
+    for (col = 0; col < 2; col++)
+      for (origin = 0; origin < 64; origin++)
+        for (dest = 0; dest < 64; dest++)
+          order->history[col][origin][dest] /= 2;
+}
+
+/*
+ * The hash move is tried before anything is generated, then captures,
+ * then killers, and quiet moves are only generated if none of those cut
+ * off. Hash moves and killers come from other positions so they are
+ * checked with board_is_legal_move(), generated moves are already legal.
+ */
+void
+init_move_picker(struct move_picker *picker, struct move_order *order,
+    struct board *board, Move hash_move)
+{
+  picker->stage = STAGE_HASH_MOVE;
+  picker->count = 0;
+  picker->index = 0;
+  picker->hash_move = hash_move;
+  picker->killers[0] = order->killers[board->ply][0];
+  picker->killers[1] = order->killers[board->ply][1];
+}
+
+/* returns 0 once every legal move has been returned */
+Move
+next_move(struct move_picker *picker, struct move_order *order,
+    struct board *board)
+{
+  Move move;
+  switch (picker->stage) {
+  case STAGE_HASH_MOVE:
+    picker->stage++;
+    if (picker->hash_move && board_is_legal_move(board, picker->hash_move))
+      return picker->hash_move;
+    picker->hash_move = 0;
+    /* fallthrough */
+  case STAGE_GENERATE_CAPTURES:
+    picker->count = board_moves(board, picker->moves, GEN_FLAG_CAPTURES);
+    score_moves(order, board, picker->moves, picker->scores, picker->count);
+    picker->index = 0;
+    picker->stage++;
+    /* fallthrough */
+  case STAGE_CAPTURES:
+    while (picker->index < picker->count) {
+      move = pick_move(picker->moves, picker->scores, picker->index++, picker->count);
+      if (move != picker->hash_move)
+        return move;
+    }
+    picker->index = 0;
+    picker->stage++;
+    /* fallthrough */
+  case STAGE_KILLERS:
+    while (picker->index < 2) {
+      move = picker->killers[picker->index++];
+      if (move && move != picker->hash_move && move_is_quiet(board, move)
+      &&  board_is_legal_move(board, move))
+        return move;
+    }
+    picker->stage++;
+    /* fallthrough */
+  case STAGE_GENERATE_QUIETS:
+    picker->count = board_moves(board, picker->moves, GEN_FLAG_QUIETS);
+    score_moves(order, board, picker->moves, picker->scores, picker->count);
+    picker->index = 0;
+    picker->stage++;
+    /* fallthrough */
+  case STAGE_QUIETS:
+    while (picker->index < picker->count) {
+      move = pick_move(picker->moves, picker->scores, picker->index++, picker->count);
+      /* quiet generation includes king captures, already tried above */
+      if (move != picker->hash_move && move != picker->killers[0]
+      &&  move != picker->killers[1] && move_is_quiet(board, move))
+        return move;
+    }
+    picker->stage++;
+    /* fallthrough */
+  default:
+    return 0;
+  }
+}
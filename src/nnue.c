@@ -0,0 +1,431 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "chess.h"
+
+/*
+ * Efficiently updatable neural network evaluation. Each side has its own
+ * view of the board: HalfKA features, one per (own king square, piece
+ * color, piece type, square), oriented so that side plays up the board.
+ * The first layer sums the weight rows of the active features into an
+ * int16 accumulator per side. board_push() records which pieces changed
+ * and the accumulator for a ply is brought up to date from the nearest
+ * computed ply below it only when that position is evaluated. A move of
+ * a side's own king changes all of its features, so that side is then
+ * recomputed from scratch.
+ *
+ * Both accumulators, side to move first, are clipped to 0..127 and fed
+ * through two clipped ReLU layers of int8 weights to a single output.
+ *
+ * The network file is mapped into memory. After a 64 byte header, each of
+ * these arrays starts on a 64 byte boundary:
+ *
+ *   int16 ft_biases[L1]             int16 ft_weights[INPUTS][L1]
+ *   int32 l1_biases[L2]             int8  l1_weights[L2][2 * L1]
+ *   int32 l2_biases[L3]             int8  l2_weights[L3][L2]
+ *   int32 out_bias                  int8  out_weights[L3]
+ */
+#define NNUE_MAGIC "CLCENNUE"
+#define NNUE_VERSION 1
+#define NNUE_HEADER_SIZE 64
+/* layer outputs are scaled down by 2^WEIGHT_SHIFT before clipping */
+#define NNUE_WEIGHT_SHIFT 6
+/* network output units per centipawn */
+#define NNUE_OUTPUT_SCALE 16
+
+struct nnue_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t l1, l2, l3;
+};
+
+struct nnue_network {
+  const int16_t *ft_biases;
+  const int16_t *ft_weights;
+  const int32_t *l1_biases;
+  const int8_t *l1_weights;
+  const int32_t *l2_biases;
+  const int8_t *l2_weights;
+  const int32_t *out_bias;
+  const int8_t *out_weights;
+  void *map;
+  size_t map_size;
+};
+
+/* the inner loops, picked for the host cpu when a network is loaded */
+struct nnue_kernels {
+  void (*add_row)(int16_t *acc, const int16_t *row);
+  void (*sub_row)(int16_t *acc, const int16_t *row);
+  void (*clip)(uint8_t *out, const int16_t *in);
+  int32_t (*dot)(const uint8_t *in, const int8_t *weights, int count);
+};
+
+static struct nnue_network network;
+static struct nnue_kernels kernels;
+static int network_loaded;
+
+/* scalar */
+
+static void
+add_row_scalar(int16_t *acc, const int16_t *row)
+{
+  int i;
+  for (i = 0; i < NNUE_L1; i++)
+    acc[i] += row[i];
+}
+static void
+sub_row_scalar(int16_t *acc, const int16_t *row)
+{
+  int i;
+  for (i = 0; i < NNUE_L1; i++)
+    acc[i] -= row[i];
+}
+static void
+clip_scalar(uint8_t *out, const int16_t *in)
+{
+  int i;
+  for (i = 0; i < NNUE_L1; i++)
+    out[i] = in[i] < 0 ? 0 : in[i] > 127 ? 127 : in[i];
+}
+static int32_t
+dot_scalar(const uint8_t *in, const int8_t *weights, int count)
+{
+  int32_t sum;
+  int i;
+  sum = 0;
+  for (i = 0; i < count; i++)
+    sum += in[i] * weights[i];
+  return sum;
+}
+
+#if defined(__x86_64__)
+
+/* sse4.1 */
+
+__attribute__((target("sse4.1"))) static void
+add_row_sse41(int16_t *acc, const int16_t *row)
+{
+  __m128i *a;
+  const __m128i *r;
+  int i;
+  a = (__m128i *)acc;
+  r = (const __m128i *)row;
+  for (i = 0; i < NNUE_L1 / 8; i++)
+    a[i] = _mm_add_epi16(a[i], _mm_load_si128(&r[i]));
+}
+__attribute__((target("sse4.1"))) static void
+sub_row_sse41(int16_t *acc, const int16_t *row)
+{
+  __m128i *a;
+  const __m128i *r;
+  int i;
+  a = (__m128i *)acc;
+  r = (const __m128i *)row;
+  for (i = 0; i < NNUE_L1 / 8; i++)
+    a[i] = _mm_sub_epi16(a[i], _mm_load_si128(&r[i]));
+}
+__attribute__((target("sse4.1"))) static void
+clip_sse41(uint8_t *out, const int16_t *in)
+{
+  const __m128i *v;
+  __m128i packed;
+  int i;
+  v = (const __m128i *)in;
+  for (i = 0; i < NNUE_L1 / 16; i++) {
+    packed = _mm_packus_epi16(v[2 * i], v[2 * i + 1]);
+    _mm_store_si128((__m128i *)out + i, _mm_min_epu8(packed, _mm_set1_epi8(127)));
+  }
+}
+__attribute__((target("sse4.1"))) static int32_t
+dot_sse41(const uint8_t *in, const int8_t *weights, int count)
+{
+  __m128i sum, product;
+  int i;
+  sum = _mm_setzero_si128();
+  for (i = 0; i < count; i += 16) {
+    product = _mm_maddubs_epi16(_mm_load_si128((const __m128i *)(in + i)),
+        _mm_load_si128((const __m128i *)(weights + i)));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(product, _mm_set1_epi16(1)));
+  }
+  sum = _mm_hadd_epi32(sum, sum);
+  sum = _mm_hadd_epi32(sum, sum);
+  return _mm_cvtsi128_si32(sum);
+}
+
+/* avx2 */
+
+__attribute__((target("avx2"))) static void
+add_row_avx2(int16_t *acc, const int16_t *row)
+{
+  __m256i *a;
+  const __m256i *r;
+  int i;
+  a = (__m256i *)acc;
+  r = (const __m256i *)row;
+  for (i = 0; i < NNUE_L1 / 16; i++)
+    a[i] = _mm256_add_epi16(a[i], _mm256_load_si256(&r[i]));
+}
+__attribute__((target("avx2"))) static void
+sub_row_avx2(int16_t *acc, const int16_t *row)
+{
+  __m256i *a;
+  const __m256i *r;
+  int i;
+  a = (__m256i *)acc;
+  r = (const __m256i *)row;
+  for (i = 0; i < NNUE_L1 / 16; i++)
+    a[i] = _mm256_sub_epi16(a[i], _mm256_load_si256(&r[i]));
+}
+__attribute__((target("avx2"))) static void
+clip_avx2(uint8_t *out, const int16_t *in)
+{
+  const __m256i *v;
+  __m256i packed;
+  int i;
+  v = (const __m256i *)in;
+  for (i = 0; i < NNUE_L1 / 32; i++) {
+    /* packing works within 128 bit lanes, so put the quarters back in order */
+    packed = _mm256_packus_epi16(v[2 * i], v[2 * i + 1]);
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    _mm256_store_si256((__m256i *)out + i, _mm256_min_epu8(packed, _mm256_set1_epi8(127)));
+  }
+}
+__attribute__((target("avx2"))) static int32_t
+dot_avx2(const uint8_t *in, const int8_t *weights, int count)
+{
+  __m256i sum, product;
+  __m128i half;
+  int i;
+  sum = _mm256_setzero_si256();
+  for (i = 0; i < count; i += 32) {
+    product = _mm256_maddubs_epi16(_mm256_load_si256((const __m256i *)(in + i)),
+        _mm256_load_si256((const __m256i *)(weights + i)));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(product, _mm256_set1_epi16(1)));
+  }
+  half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  half = _mm_hadd_epi32(half, half);
+  half = _mm_hadd_epi32(half, half);
+  return _mm_cvtsi128_si32(half);
+}
+
+#endif
+
+static void
+select_kernels(void)
+{
+  kernels = (struct nnue_kernels){ add_row_scalar, sub_row_scalar, clip_scalar, dot_scalar };
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    kernels = (struct nnue_kernels){ add_row_avx2, sub_row_avx2, clip_avx2, dot_avx2 };
+  else if (__builtin_cpu_supports("sse4.1"))
+    kernels = (struct nnue_kernels){ add_row_sse41, sub_row_sse41, clip_sse41, dot_sse41 };
+#endif
+}
+
+static const void *
+take_section(const uint8_t *base, size_t *offset, size_t size, size_t map_size)
+{
+  const void *section;
+  *offset = (*offset + 63) & ~(size_t)63;
+  if (*offset + size > map_size)
+    return NULL;
+  section = base + *offset;
+  *offset += size;
+  return section;
+}
+
+int
+nnue_load(const char *path)
+{
+  struct nnue_network net;
+  const struct nnue_header *header;
+  struct stat st;
+  size_t offset;
+  int fd;
+  if ( (fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return 1;
+  }
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return 1;
+  }
+  net.map_size = st.st_size;
+  net.map = mmap(NULL, net.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (net.map == MAP_FAILED) {
+    perror(path);
+    return 1;
+  }
+  header = net.map;
+  if (net.map_size < NNUE_HEADER_SIZE
+  ||  memcmp(header->magic, NNUE_MAGIC, sizeof(header->magic))
+  ||  header->version != NNUE_VERSION
+  ||  header->l1 != NNUE_L1 || header->l2 != NNUE_L2 || header->l3 != NNUE_L3) {
+    fprintf(stderr, "%s: not a version %d network of size %dx%dx%d\n",
+        path, NNUE_VERSION, NNUE_L1, NNUE_L2, NNUE_L3);
+    munmap(net.map, net.map_size);
+    return 1;
+  }
+  offset = NNUE_HEADER_SIZE;
+  net.ft_biases = take_section(net.map, &offset, sizeof(int16_t) * NNUE_L1, net.map_size);
+  net.ft_weights = take_section(net.map, &offset, sizeof(int16_t) * NNUE_INPUTS * NNUE_L1, net.map_size);
+  net.l1_biases = take_section(net.map, &offset, sizeof(int32_t) * NNUE_L2, net.map_size);
+  net.l1_weights = take_section(net.map, &offset, 2 * NNUE_L1 * NNUE_L2, net.map_size);
+  net.l2_biases = take_section(net.map, &offset, sizeof(int32_t) * NNUE_L3, net.map_size);
+  net.l2_weights = take_section(net.map, &offset, NNUE_L2 * NNUE_L3, net.map_size);
+  net.out_bias = take_section(net.map, &offset, sizeof(int32_t), net.map_size);
+  net.out_weights = take_section(net.map, &offset, NNUE_L3, net.map_size);
+  if (net.out_weights == NULL) {
+    fprintf(stderr, "%s: truncated network\n", path);
+    munmap(net.map, net.map_size);
+    return 1;
+  }
+  nnue_unload();
+  select_kernels();
+  network = net;
+  network_loaded = 1;
+  return 0;
+}
+
+void
+nnue_unload(void)
+{
+  if (!network_loaded)
+    return;
+  munmap(network.map, network.map_size);
+  network_loaded = 0;
+}
+
+int
+nnue_enabled(void)
+{
+  return network_loaded;
+}
+
+/* starts incremental updates at the board's current ply */
+void
+nnue_reset(struct board *board, struct nnue_accumulator *stack)
+{
+  struct nnue_accumulator *acc;
+  board->nnue = stack;
+  acc = &stack[board->ply];
+  acc->computed[0] = acc->computed[1] = 0;
+  acc->refresh[0] = acc->refresh[1] = 1;
+  acc->dirty_count = 0;
+}
+
+static inline const int16_t *
+feature_row(int perspective, int king_sq, int col, int piece_type, int square)
+{
+  int flip, index;
+  flip = perspective == COLOR_WHITE ? 0 : 56;
+  index = (king_sq ^ flip) * 768 + (col != perspective) * 384
+    + piece_type * 64 + (square ^ flip);
+  return network.ft_weights + (size_t)index * NNUE_L1;
+}
+
+static void
+refresh_accumulator(struct position *pos, int16_t *values, int perspective)
+{
+  Bitboard pieces;
+  int col, piece_type, king_sq;
+  king_sq = lss(pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[perspective]);
+  memcpy(values, network.ft_biases, sizeof(int16_t) * NNUE_L1);
+  for (col = 0; col < 2; col++)
+    for (piece_type = 0; piece_type <= PIECE_TYPE_KING; piece_type++) {
+      pieces = pos->type_bitboards[piece_type] & pos->color_bitboards[col];
+      while (pieces)
+        kernels.add_row(values, feature_row(perspective, king_sq, col, piece_type, pop_lss(&pieces)));
+    }
+}
+
+static void
+update_accumulator(struct board *board, int perspective)
+{
+  struct position *pos;
+  struct nnue_accumulator *stack;
+  struct nnue_dirty_piece *dirty;
+  int ply, king_sq, i;
+  pos = board_position(board);
+  stack = board->nnue;
+  for (ply = board->ply; !stack[ply].computed[perspective]; ply--) {
+    if (stack[ply].refresh[perspective]) {
+      refresh_accumulator(pos, stack[board->ply].values[perspective], perspective);
+      stack[board->ply].computed[perspective] = 1;
+      return;
+    }
+  }
+  /* the king has not moved since the computed ply */
+  king_sq = lss(pos->type_bitboards[PIECE_TYPE_KING] & pos->color_bitboards[perspective]);
+  for (ply++; ply <= board->ply; ply++) {
+    memcpy(stack[ply].values[perspective], stack[ply - 1].values[perspective],
+        sizeof(int16_t) * NNUE_L1);
+    for (i = 0; i < stack[ply].dirty_count; i++) {
+      dirty = &stack[ply].dirty[i];
+      if (dirty->delta > 0)
+        kernels.add_row(stack[ply].values[perspective],
+            feature_row(perspective, king_sq, dirty->color, dirty->piece_type, dirty->square));
+      else
+        kernels.sub_row(stack[ply].values[perspective],
+            feature_row(perspective, king_sq, dirty->color, dirty->piece_type, dirty->square));
+    }
+    stack[ply].computed[perspective] = 1;
+  }
+}
+
+static inline int
+clip_output(int32_t sum)
+{
+  sum >>= NNUE_WEIGHT_SHIFT;
+  return sum < 0 ? 0 : sum > 127 ? 127 : sum;
+}
+
+/* centipawns from white's point of view */
+int
+nnue_evaluate(struct board *board)
+{
+  struct nnue_accumulator *acc;
+  uint8_t input[2 * NNUE_L1] __attribute__((aligned(64)));
+  uint8_t hidden1[NNUE_L2] __attribute__((aligned(64)));
+  uint8_t hidden2[NNUE_L3] __attribute__((aligned(64)));
+  int32_t output;
+  int col, i;
+  assert(network_loaded);
+  col = board_turn(board);
+  acc = &board->nnue[board->ply];
+  update_accumulator(board, COLOR_WHITE);
+  update_accumulator(board, COLOR_BLACK);
+#ifdef CHECK_EVALUATION
+  {
+    int16_t values[NNUE_L1] __attribute__((aligned(64)));
+    for (i = 0; i < 2; i++) {
+      refresh_accumulator(board_position(board), values, i);
+      assert(memcmp(values, acc->values[i], sizeof(values)) == 0);
+    }
+  }
+#endif
+  kernels.clip(input, acc->values[col]);
+  kernels.clip(input + NNUE_L1, acc->values[!col]);
+  for (i = 0; i < NNUE_L2; i++)
+    hidden1[i] = clip_output(network.l1_biases[i]
+        + kernels.dot(input, network.l1_weights + i * 2 * NNUE_L1, 2 * NNUE_L1));
+  for (i = 0; i < NNUE_L3; i++)
+    hidden2[i] = clip_output(network.l2_biases[i]
+        + kernels.dot(hidden1, network.l2_weights + i * NNUE_L2, NNUE_L2));
+  output = *network.out_bias + dot_scalar(hidden2, network.out_weights, NNUE_L3);
+  output /= NNUE_OUTPUT_SCALE;
+  return col == COLOR_WHITE ? output : -output;
+}
@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "chess.h"
+
+/*
+ * Pawn structure only depends on the pawns, so it is evaluated once per
+ * pawn_hash and cached. Every search thread has its own table, allocated
+ * the first time that thread evaluates a position, so no locking is
+ * needed. Terms that also depend on the kings are computed at each leaf
+ * from the cached open files.
+ */
+#define PAWN_TABLE_BITS 16
+#define PAWN_TABLE_SIZE (1 << PAWN_TABLE_BITS)
+
+#define NOT_FILE_A 0xfefefefefefefefeULL
+#define NOT_FILE_H 0x7f7f7f7f7f7f7f7fULL
+
+struct pawn_entry {
+  uint64_t key;
+  int16_t mg_score, eg_score;
+  /* files without pawns of each color, bit per file */
+  uint8_t open_files[2];
+};
+
+struct pawn_table {
+  struct pawn_entry entries[PAWN_TABLE_SIZE];
+  long hits, misses;
+};
+
+static __thread struct pawn_table *pawn_table;
+
+/* centipawns, white's point of view for passed pawns by rank */
+static const int passed_mg[8] = { 0, 5, 10, 15, 25, 40, 60, 0 };
+static const int passed_eg[8] = { 0, 10, 20, 35, 60, 100, 150, 0 };
+#define DOUBLED_MG  (-10)
+#define DOUBLED_EG  (-20)
+#define ISOLATED_MG (-10)
+#define ISOLATED_EG (-15)
+#define BACKWARD_MG (-8)
+#define BACKWARD_EG (-10)
+#define SHIELD_MG   10
+#define SEMI_OPEN_KING_FILE_MG (-15)
+#define OPEN_KING_FILE_MG      (-10)
+
+static inline Bitboard
+north_fill(Bitboard b)
+{
+  b |= b << 8;
+  b |= b << 16;
+  b |= b << 32;
+  return b;
+}
+static inline Bitboard
+south_fill(Bitboard b)
+{
+  b |= b >> 8;
+  b |= b >> 16;
+  b |= b >> 32;
+  return b;
+}
+static inline Bitboard
+forward_fill(Bitboard b, int col)
+{
+  return col == COLOR_WHITE ? north_fill(b) : south_fill(b);
+}
+static inline Bitboard
+forward(Bitboard b, int col)
+{
+  return col == COLOR_WHITE ? b << 8 : b >> 8;
+}
+static inline Bitboard
+side_squares(Bitboard b)
+{
+  return ((b << 1) & NOT_FILE_A) | ((b >> 1) & NOT_FILE_H);
+}
+/* bit per file with at least one of the pieces */
+static inline int
+file_set(Bitboard b)
+{
+  return south_fill(b) & 0xff;
+}
+
+/* scores one color's pawns as a positive bonus for that color */
+static void
+evaluate_pawns(Bitboard pawns[2], int col, int *mg, int *eg)
+{
+  Bitboard mine, theirs, files, their_span, attacks, their_attacks;
+  Bitboard passed, doubled, isolated, backward;
+  int square, rank;
+  mine = pawns[col];
+  theirs = pawns[!col];
+  their_span = forward_fill(forward(theirs, !col), !col);
+  files = north_fill(south_fill(mine));
+  attacks = side_squares(forward(mine, col));
+  their_attacks = side_squares(forward(theirs, !col));
+
+  /* pawns with one of ours in front, only the front one can be passed */
+  doubled = mine & forward_fill(forward(mine, !col), !col);
+  passed = mine & ~doubled & ~(their_span | side_squares(their_span));
+  isolated = mine & ~side_squares(files);
+  /* the stop square is attacked and no pawn of ours can ever defend it */
+  backward = mine & ~isolated
+    & forward(their_attacks & ~forward_fill(attacks, col), !col);
+
+  *mg = count_bits(doubled) * DOUBLED_MG
+    + count_bits(isolated) * ISOLATED_MG
+    + count_bits(backward) * BACKWARD_MG;
+  *eg = count_bits(doubled) * DOUBLED_EG
+    + count_bits(isolated) * ISOLATED_EG
+    + count_bits(backward) * BACKWARD_EG;
+  while (passed) {
+    square = pop_lss(&passed);
+    rank = col == COLOR_WHITE ? square / 8 : 7 - square / 8;
+    *mg += passed_mg[rank];
+    *eg += passed_eg[rank];
+  }
+}
+
+static void
+fill_pawn_entry(const Bitboard *type_bitboards, const Bitboard *color_bitboards,
+    struct pawn_entry *entry)
+{
+  Bitboard pawns[2];
+  int mg, eg, col;
+  entry->mg_score = entry->eg_score = 0;
+  for (col = 0; col < 2; col++) {
+    pawns[col] = type_bitboards[PIECE_TYPE_PAWN] & color_bitboards[col];
+    entry->open_files[col] = ~file_set(pawns[col]);
+  }
+  for (col = 0; col < 2; col++) {
+    evaluate_pawns(pawns, col, &mg, &eg);
+    entry->mg_score += col == COLOR_WHITE ? mg : -mg;
+    entry->eg_score += col == COLOR_WHITE ? eg : -eg;
+  }
+}
+
+static struct pawn_entry *
+probe_pawn_table(struct position *pos)
+{
+  struct pawn_entry *entry;
+  if (pawn_table == NULL) {
+    if ( (pawn_table = calloc(1, sizeof(struct pawn_table))) == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    /* a zero key must not match an empty entry */
+    pawn_table->entries[0].key = 1;
+  }
+  entry = &pawn_table->entries[pos->pawn_hash & (PAWN_TABLE_SIZE - 1)];
+  if (entry->key == pos->pawn_hash) {
+    pawn_table->hits++;
+    return entry;
+  }
+  pawn_table->misses++;
+  entry->key = pos->pawn_hash;
+  fill_pawn_entry(pos->type_bitboards, pos->color_bitboards, entry);
+  return entry;
+}
+
+/* pawns in front of the king and open files around it, midgame only */
+static int
+king_shelter(const Bitboard *type_bitboards, const Bitboard *color_bitboards,
+    struct pawn_entry *entry, int col)
+{
+  Bitboard king, zone, pawns;
+  int files, score;
+  king = type_bitboards[PIECE_TYPE_KING] & color_bitboards[col];
+  zone = king | side_squares(king);
+  pawns = type_bitboards[PIECE_TYPE_PAWN] & color_bitboards[col];
+  score = count_bits(pawns & (forward(zone, col) | forward(forward(zone, col), col)))
+    * SHIELD_MG;
+  files = file_set(zone);
+  score += count_bits(files & entry->open_files[col]) * SEMI_OPEN_KING_FILE_MG;
+  score += count_bits(files & entry->open_files[col] & entry->open_files[!col])
+    * OPEN_KING_FILE_MG;
+  return score;
+}
+
+void
+evaluate_pawn_structure(struct position *pos, int *mg, int *eg)
+{
+  struct pawn_entry *entry;
+  entry = probe_pawn_table(pos);
+  *mg = entry->mg_score
+    + king_shelter(pos->type_bitboards, pos->color_bitboards, entry, COLOR_WHITE)
+    - king_shelter(pos->type_bitboards, pos->color_bitboards, entry, COLOR_BLACK);
+  *eg = entry->eg_score;
+}
+
+/* the same terms without the table, for positions outside any search */
+void
+find_pawn_structure(const Bitboard *type_bitboards, const Bitboard *color_bitboards,
+    int *mg, int *eg)
+{
+  struct pawn_entry entry;
+  fill_pawn_entry(type_bitboards, color_bitboards, &entry);
+  *mg = entry.mg_score
+    + king_shelter(type_bitboards, color_bitboards, &entry, COLOR_WHITE)
+    - king_shelter(type_bitboards, color_bitboards, &entry, COLOR_BLACK);
+  *eg = entry.eg_score;
+}
+
+/* returns and clears the calling thread's counters */
+void
+pawn_table_counters(long *hits, long *misses)
+{
+  *hits = *misses = 0;
+  if (pawn_table == NULL)
+    return;
+  *hits = pawn_table->hits;
+  *misses = pawn_table->misses;
+  pawn_table->hits = pawn_table->misses = 0;
+}
+
+/* threads that exit must release their table */
+void
+free_pawn_table(void)
+{
+  free(pawn_table);
+  pawn_table = NULL;
+}
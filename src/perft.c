@@ -0,0 +1,203 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "chess.h"
+
+/*
+ * Perft is split into one task per pair of root and reply moves. Each
+ * worker owns a deque of tasks on its own cache line, takes work from the
+ * tail of its own deque and steals from the head of the others when it
+ * runs out. A deque is a [head, tail) range packed into one word, so both
+ * ends are updated with a single compare and swap.
+ */
+
+struct perft_task {
+  int root;
+  Move reply;
+};
+
+struct perft_deque {
+  uint64_t range; /* head in the low 32 bits, tail in the high 32 bits */
+} __attribute__((aligned(64)));
+
+struct perft_job {
+  struct board *board;
+  int depth, gen_flags;
+  int thread_count;
+  Move root_moves[256];
+  long root_counts[256];
+  struct perft_task *tasks;
+  struct perft_deque *deques;
+};
+
+struct perft_worker {
+  pthread_t thread;
+  struct perft_job *job;
+  int id;
+};
+
+static long
+perft_recurse(struct board *board, int depth, int gen_flags)
+{
+  Move moves[256];
+  long sum;
+  int move_count, i;
+  if (depth == 0)
+    return 1;
+  move_count = board_moves(board, moves, gen_flags);
+  /* board_moves only generates legal moves so leaves need not be made */
+  if (depth == 1)
+    return move_count;
+  sum = 0;
+  for (i = 0; i < move_count; i++) {
+    board_push(board, moves[i]);
+    sum += perft_recurse(board, depth - 1, gen_flags);
+    board_pop(board, moves[i]);
+  }
+  return sum;
+}
+
+static int
+take_task(struct perft_deque *deque, int *task)
+{
+  uint64_t range, new_range;
+  uint32_t head, tail;
+  range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+  do {
+    head = range;
+    tail = range >> 32;
+    if (head == tail)
+      return 0;
+    new_range = head | (uint64_t)(tail - 1) << 32;
+  } while (!__atomic_compare_exchange_n(&deque->range, &range, new_range, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  *task = tail - 1;
+  return 1;
+}
+
+static int
+steal_task(struct perft_deque *deque, int *task)
+{
+  uint64_t range, new_range;
+  uint32_t head, tail;
+  range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+  do {
+    head = range;
+    tail = range >> 32;
+    if (head == tail)
+      return 0;
+    new_range = (head + 1) | (uint64_t)tail << 32;
+  } while (!__atomic_compare_exchange_n(&deque->range, &range, new_range, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  *task = head;
+  return 1;
+}
+
+static void *
+perft_worker(void *arg)
+{
+  struct perft_worker *worker;
+  struct perft_job *job;
+  struct perft_task *task;
+  struct board board;
+  Move root_move;
+  long count;
+  int task_index, i;
+  worker = arg;
+  job = worker->job;
+  board = *job->board;
+  for (;;) {
+    if (!take_task(&job->deques[worker->id], &task_index)) {
+      for (i = 1; i < job->thread_count; i++)
+        if (steal_task(&job->deques[(worker->id + i) % job->thread_count], &task_index))
+          break;
+      if (i >= job->thread_count)
+        break;
+    }
+    task = &job->tasks[task_index];
+    root_move = job->root_moves[task->root];
+    board_push(&board, root_move);
+    board_push(&board, task->reply);
+    count = perft_recurse(&board, job->depth - 2, job->gen_flags);
+    board_pop(&board, task->reply);
+    board_pop(&board, root_move);
+    __atomic_fetch_add(&job->root_counts[task->root], count, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* prints the node count below each root move */
+long
+perft(struct board *board, int depth, int gen_flags, int thread_count)
+{
+  struct perft_job job;
+  struct perft_worker *workers;
+  Move replies[256];
+  long sum;
+  int root_count, task_count, reply_count, per_thread, first, last, i, j;
+  if (depth == 0)
+    return 1;
+  job.board = board;
+  job.depth = depth;
+  job.gen_flags = gen_flags;
+  root_count = board_moves(board, job.root_moves, gen_flags);
+  if (root_count == 0)
+    printf("\n");
+  for (i = 0; i < root_count; i++)
+    job.root_counts[i] = 1;
+
+  if (depth > 1) {
+    task_count = 0;
+    job.tasks = xmalloc(root_count * 256 * sizeof(struct perft_task));
+    for (i = 0; i < root_count; i++) {
+      job.root_counts[i] = 0;
+      board_push(board, job.root_moves[i]);
+      reply_count = board_moves(board, replies, gen_flags);
+      board_pop(board, job.root_moves[i]);
+      for (j = 0; j < reply_count; j++) {
+        job.tasks[task_count].root = i;
+        job.tasks[task_count].reply = replies[j];
+        task_count++;
+      }
+    }
+
+    if (thread_count < 1)
+      thread_count = 1;
+    job.thread_count = thread_count;
+    if ( (job.deques = aligned_alloc(64, thread_count * sizeof(struct perft_deque))) == NULL) {
+      perror("aligned_alloc");
+      exit(1);
+    }
+    workers = xmalloc(thread_count * sizeof(struct perft_worker));
+    per_thread = (task_count + thread_count - 1) / thread_count;
+    for (i = 0; i < thread_count; i++) {
+      first = i * per_thread < task_count ? i * per_thread : task_count;
+      last = first + per_thread < task_count ? first + per_thread : task_count;
+      job.deques[i].range = (uint32_t)first | (uint64_t)last << 32;
+      workers[i].job = &job;
+      workers[i].id = i;
+    }
+    for (i = 1; i < thread_count; i++)
+      if (pthread_create(&workers[i].thread, NULL, perft_worker, &workers[i])) {
+        perror("pthread_create");
+        exit(1);
+      }
+    perft_worker(&workers[0]);
+    for (i = 1; i < thread_count; i++)
+      pthread_join(workers[i].thread, NULL);
+    free(workers);
+    free(job.deques);
+    free(job.tasks);
+  }
+
+  sum = 0;
+  for (i = 0; i < root_count; i++) {
+    print_move(job.root_moves[i]);
+    printf(":%ld%c", job.root_counts[i], i == root_count - 1 ? '\n' : ' ');
+    sum += job.root_counts[i];
+  }
+  return sum;
+}
@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "chess.h"
+
+/*
+ * Slow reference attack generation for the sliders, shared by the build
+ * tools that search for magic numbers and generate the attack tables.
+ * None of this is linked into the engine.
+ */
+
+/* the tools never detect the cpu, so count_bits() uses its portable loop */
+int cpu_features;
+
+uint64_t rook_relevance_masks[64];
+uint64_t bishop_relevance_masks[64];
+
+void
+init_relevance_masks(void)
+{
+  int i, j;
+  for (i = 0; i < 64; i++) {
+    rook_relevance_masks[i] = 0;
+    /* vertical */
+    for (j = i % 8 + 8; j  < 8 * 7; j += 8) {
+      if (j == i)
+        continue;
+      rook_relevance_masks[i] |= (uint64_t)1 << j;
+    }
+    /* horizontal */
+    for (j = i - i % 8 + 1; j < i - i % 8 + 7; j++) {
+      if (j == i)
+        continue;
+      rook_relevance_masks[i] |= (uint64_t)1 << j;
+    }
+  }
+  for (i = 0; i < 64; i++) {
+    bishop_relevance_masks[i] = 0;
+    /* north east */
+    if (i % 8 < 6)
+      for (j = i + 9; j < 8 * 7 && j % 8 != 7; j += 9)
+        bishop_relevance_masks[i] |= (uint64_t)1 << j;
+    /* south west */
+    if (i % 8 > 1)
+      for (j = i - 9; j > 7 && j % 8; j -= 9)
+        bishop_relevance_masks[i] |= (uint64_t)1 << j;
+    /* north west */
+    if (i % 8 > 1)
+      for (j = i + 7; j < 8 * 7 && j % 8; j += 7)
+        bishop_relevance_masks[i] |= (uint64_t)1 << j;
+    /* south east */
+    if (i % 8 < 6)
+      for (j = i - 7; j > 7 && j % 8 != 7; j -= 7)
+        bishop_relevance_masks[i] |= (uint64_t)1 << j;
+  }
+}
+
+uint64_t
+primitive_bishop_attack_squares(int square, uint64_t blockers)
+{
+  int i;
+  uint64_t attacks;
+  attacks = 0;
+  /* north east */
+  for (i = square + 9; i < 64 && i % 8 != 0; i += 9) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  /* south east */
+  for (i = square - 7; i >= 0 && i % 8 != 0; i -= 7) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  /* north west */
+  for (i = square + 7; i < 64 && i % 8 != 7; i += 7) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  /* south west */
+  for (i = square - 9; i >= 0 && i % 8 != 7; i -= 9) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  return attacks;
+}
+
+uint64_t
+primitive_rook_attack_squares(int square, uint64_t blockers)
+{
+  int i;
+  uint64_t attacks;
+  attacks = 0;
+  /* north */
+  for (i = square + 8; i < 64; i += 8) {
+    attacks|= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  /* south */
+  for (i = square - 8; i >= 0; i -= 8) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  /* east */
+  for (i = square + 1; i % 8 != 0; i++) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  /* west */
+  for (i = square - 1; i % 8 != 7 && i >= 0; i--) {
+    attacks |= (uint64_t)1 << i;
+    if (blockers & ((uint64_t)1 << i))
+      break;
+  }
+  return attacks;
+}
+
+uint64_t
+generate_mock_blockers(uint64_t mask, int index)
+{
+  uint64_t blockers, bit;
+  blockers = 0;
+  while (index) {
+    if (mask == 0) {
+      fprintf(stderr, "failed to generate blockers: index too high\n");
+      exit(1);
+    }
+    bit = pop_lsb(&mask);
+    if (index & 1)
+      blockers |= bit;
+    index >>= 1;
+  }
+  return blockers;
+}
+
+int
+init_magic_square(int square, int rook, uint64_t magic, int bits,
+    uint64_t *attack_table)
+{
+  uint64_t relevance_mask, blockers, hash, attacks;
+  int i, relevant_square_count, table_size;
+  relevance_mask = rook
+    ? rook_relevance_masks[square]
+    : bishop_relevance_masks[square];
+  relevant_square_count = count_bits(relevance_mask);
+  memset(attack_table, 0, ((uint64_t)1 << bits) * sizeof(uint64_t));
+  table_size = 0;
+  for (i = 0; i < ((uint64_t)1 << relevant_square_count); i++) {
+    blockers = generate_mock_blockers(relevance_mask, i);
+    hash = (blockers * magic) >> (64 - bits);
+    attacks = rook
+      ? primitive_rook_attack_squares(square, blockers)
+      : primitive_bishop_attack_squares(square, blockers);
+    if (hash >= table_size)
+      table_size = hash + 1;
+    if (attack_table[hash] == 0)
+      attack_table[hash] = attacks;
+    else if (attack_table[hash] != attacks)
+      return 0;
+  }
+  return table_size;
+}
+
+/* true if sub_table fits at offset without clobbering a different set */
+static int
+sub_table_fits(const uint64_t *table, const uint64_t *sub_table, int size,
+    int offset)
+{
+  int i;
+  for (i = 0; i < size; i++)
+    if (sub_table[i] && table[offset + i] && table[offset + i] != sub_table[i])
+      return 0;
+  return 1;
+}
+
+/*
+ * Packs the sub-tables of all 128 squares into one table, letting them
+ * overlap where every slot used by both holds the same attack set. First
+ * fit, largest sub-tables first so the small ones fill the gaps. Returns
+ * the table and stores its size and each square's offset, or returns NULL
+ * if a magic number does not work.
+ */
+uint64_t *
+pack_magic_tables(const struct magic_square *magics, int *offsets, int *size)
+{
+  uint64_t *sub_tables[128], *table;
+  int sizes[128], order[128];
+  int i, j, k, offset, total;
+  total = 0;
+  for (i = 0; i < 128; i++) {
+    sub_tables[i] = xmalloc(((uint64_t)1 << magics[i].bits) * sizeof(uint64_t));
+    sizes[i] = init_magic_square(i % 64, i > 63, magics[i].magic, magics[i].bits,
+        sub_tables[i]);
+    if (sizes[i] == 0) {
+      for (; i >= 0; i--)
+        free(sub_tables[i]);
+      return NULL;
+    }
+    total += sizes[i];
+    for (j = i; j > 0 && sizes[order[j - 1]] < sizes[i]; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  if ( (table = calloc(total, sizeof(uint64_t))) == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  *size = 0;
+  for (k = 0; k < 128; k++) {
+    i = order[k];
+    for (offset = 0; !sub_table_fits(table, sub_tables[i], sizes[i], offset); offset++);
+    for (j = 0; j < sizes[i]; j++)
+      if (sub_tables[i][j])
+        table[offset + j] = sub_tables[i][j];
+    if (offset + sizes[i] > *size)
+      *size = offset + sizes[i];
+    offsets[i] = offset;
+    free(sub_tables[i]);
+  }
+  return table;
+}
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chess.h"
+
+#define TT_BUCKET_COUNT ((uint64_t)1 << TT_BUCKET_BITS)
+#define TT_AGE_MASK 0x3f
+
+/* scores this close to CHECKMATE_EVALUATION are mates */
+#define MATE_THRESHOLD (CHECKMATE_EVALUATION - MAX_SEARCH_PLY)
+
+/*
+ * The table is shared by all search threads without locks. Each entry
+ * stores its key XORed with its data, so an entry torn by two threads
+ * writing at once fails verification instead of returning another
+ * position's data.
+ */
+struct tt_bucket {
+  struct tt_entry entries[TT_BUCKET_SIZE];
+} __attribute__((aligned(64)));
+
+static struct tt_bucket table[TT_BUCKET_COUNT];
+static int age;
+
+static inline uint64_t
+pack_data(Move move, int score, int depth, int bound)
+{
+  assert(depth >= 0 && depth < 256);
+  return (uint64_t)move
+    | (uint64_t)(uint32_t)score << 16
+    | (uint64_t)depth << 48
+    | (uint64_t)bound << 56
+    | (uint64_t)age << 58;
+}
+static inline Move
+data_move(uint64_t data)
+{
+  return data & 0xffff;
+}
+static inline int
+data_score(uint64_t data)
+{
+  return (int32_t)(uint32_t)(data >> 16);
+}
+static inline int
+data_depth(uint64_t data)
+{
+  return (data >> 48) & 0xff;
+}
+static inline int
+data_bound(uint64_t data)
+{
+  return (data >> 56) & 0x03;
+}
+static inline int
+data_age(uint64_t data)
+{
+  return (data >> 58) & TT_AGE_MASK;
+}
+
+/*
+ * Mate scores count plies from the root, but the table is shared between
+ * nodes at different plies, so store them relative to the current node.
+ */
+static int
+score_to_tt(int score, int ply)
+{
+  if (score > MATE_THRESHOLD)
+    return score + ply;
+  if (score < -MATE_THRESHOLD)
+    return score - ply;
+  return score;
+}
+static int
+score_from_tt(int score, int ply)
+{
+  if (score > MATE_THRESHOLD)
+    return score - ply;
+  if (score < -MATE_THRESHOLD)
+    return score + ply;
+  return score;
+}
+
+void
+tt_clear(void)
+{
+  memset(table, 0, sizeof(table));
+  age = 0;
+}
+
+void
+tt_new_search(void)
+{
+  age = (age + 1) & TT_AGE_MASK;
+}
+
+int
+tt_probe(uint64_t hash, int ply, Move *move, int *depth, int *bound, int *score)
+{
+  struct tt_bucket *bucket;
+  uint64_t key, data;
+  int i;
+  bucket = &table[hash & (TT_BUCKET_COUNT - 1)];
+  for (i = 0; i < TT_BUCKET_SIZE; i++) {
+    key = __atomic_load_n(&bucket->entries[i].key, __ATOMIC_RELAXED);
+    data = __atomic_load_n(&bucket->entries[i].data, __ATOMIC_RELAXED);
+    if ((key ^ data) != hash || data == 0)
+      continue;
+    *move = data_move(data);
+    *depth = data_depth(data);
+    *bound = data_bound(data);
+    *score = score_from_tt(data_score(data), ply);
+    return 1;
+  }
+  return 0;
+}
+
+void
+tt_store(uint64_t hash, int ply, Move move, int depth, int bound, int score)
+{
+  struct tt_bucket *bucket;
+  struct tt_entry *replace;
+  uint64_t key, data;
+  int i, worth, replace_worth;
+  bucket = &table[hash & (TT_BUCKET_COUNT - 1)];
+  replace = NULL;
+  replace_worth = 0;
+  for (i = 0; i < TT_BUCKET_SIZE; i++) {
+    key = __atomic_load_n(&bucket->entries[i].key, __ATOMIC_RELAXED);
+    data = __atomic_load_n(&bucket->entries[i].data, __ATOMIC_RELAXED);
+    if ((key ^ data) == hash) {
+      /* keep a deeper result from this search unless the new one is exact */
+      if (bound != TT_BOUND_EXACT && depth < data_depth(data)
+      &&  data_age(data) == age)
+        return;
+      if (move == 0)
+        move = data_move(data);
+      replace = &bucket->entries[i];
+      break;
+    }
+    /* prefer to replace shallow entries left over from earlier searches */
+    worth = data_depth(data) - 8 * ((age - data_age(data)) & TT_AGE_MASK);
+    if (replace == NULL || worth < replace_worth) {
+      replace = &bucket->entries[i];
+      replace_worth = worth;
+    }
+  }
+  data = pack_data(move, score_to_tt(score, ply), depth, bound);
+  __atomic_store_n(&replace->key, hash ^ data, __ATOMIC_RELAXED);
+  __atomic_store_n(&replace->data, data, __ATOMIC_RELAXED);
+}